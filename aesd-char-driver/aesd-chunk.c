@@ -0,0 +1,303 @@
+/**
+ * @file aesd-chunk.c
+ * @brief Packed and optionally LZ4 compressed storage of aesdchar entries
+ */
+
+#include <linux/kernel.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/printk.h>
+#include <linux/lz4.h>
+
+#include "aesd-chunk.h"
+
+#if IS_ENABLED(CONFIG_LZ4_COMPRESS) && IS_ENABLED(CONFIG_LZ4_DECOMPRESS)
+#define AESD_HAVE_LZ4 1
+#else
+#define AESD_HAVE_LZ4 0
+#endif
+
+static struct aesd_chunk *aesd_chunk_alloc(struct aesd_chunk_store *store, size_t alloc)
+{
+    struct aesd_chunk *chunk = kzalloc(sizeof(struct aesd_chunk), GFP_KERNEL);
+
+    if (!chunk)
+        return NULL;
+
+    chunk->data = kvmalloc(alloc, GFP_KERNEL);
+    if (!chunk->data) {
+        kfree(chunk);
+        return NULL;
+    }
+    chunk->alloc = alloc;
+    chunk->id = ++store->next_id;
+    return chunk;
+}
+
+static void aesd_chunk_free(struct aesd_chunk_store *store, struct aesd_chunk *chunk)
+{
+    int slot;
+
+    // Drop the decompressed copy too rather than wait for it to age out
+    for (slot = 0; slot < AESD_CHUNK_CACHE_SLOTS; slot++) {
+        if (store->cache[slot].id == chunk->id)
+            store->cache[slot].id = 0;
+    }
+
+    kvfree(chunk->data);
+    kfree(chunk);
+}
+
+static void aesd_chunk_compress(struct aesd_chunk_store *store, struct aesd_chunk *chunk)
+{
+#if AESD_HAVE_LZ4
+    int bound = LZ4_compressBound(chunk->size);
+    char *compressed;
+    int size;
+
+    if (!bound)
+        return;
+
+    compressed = kvmalloc(bound, GFP_KERNEL);
+    if (!compressed)
+        return;
+
+    size = LZ4_compress_default(chunk->data, compressed, chunk->size, bound, store->lz4_wrkmem);
+    if (size <= 0 || (size_t)size >= chunk->size) {
+        // Not worth it, keep the chunk as it is
+        kvfree(compressed);
+        return;
+    }
+
+    kvfree(chunk->data);
+    chunk->data = kvmalloc(size, GFP_KERNEL);
+    if (!chunk->data) {
+        // Keep the oversized buffer rather than lose the data
+        chunk->data = compressed;
+    } else {
+        memcpy(chunk->data, compressed, size);
+        kvfree(compressed);
+    }
+    chunk->stored = size;
+    chunk->compressed = true;
+#endif
+}
+
+/*
+ * Called once nothing more will be appended to @chunk
+ */
+static void aesd_chunk_seal(struct aesd_chunk_store *store, struct aesd_chunk *chunk)
+{
+    if (!chunk->refs) {
+        aesd_chunk_free(store, chunk);
+        return;
+    }
+
+    chunk->stored = chunk->size;
+    if (store->compress)
+        aesd_chunk_compress(store, chunk);
+}
+
+int aesd_chunk_store_init(struct aesd_chunk_store *store, bool compress)
+{
+    memset(store, 0, sizeof(struct aesd_chunk_store));
+
+    if (compress && !AESD_HAVE_LZ4) {
+        printk(KERN_WARNING "aesdchar: kernel built without LZ4, storing history uncompressed\n");
+        compress = false;
+    }
+
+#if AESD_HAVE_LZ4
+    if (compress) {
+        store->lz4_wrkmem = kvmalloc(LZ4_MEM_COMPRESS, GFP_KERNEL);
+        if (!store->lz4_wrkmem)
+            return -ENOMEM;
+    }
+#endif
+
+    store->compress = compress;
+    return 0;
+}
+
+void aesd_chunk_store_destroy(struct aesd_chunk_store *store)
+{
+    int slot;
+
+    if (store->open)
+        aesd_chunk_free(store, store->open);
+    store->open = NULL;
+
+    for (slot = 0; slot < AESD_CHUNK_CACHE_SLOTS; slot++)
+        kvfree(store->cache[slot].data);
+    kvfree(store->lz4_wrkmem);
+    memset(store, 0, sizeof(struct aesd_chunk_store));
+}
+
+static void aesd_chunk_push_large(struct aesd_chunk_spare *spare, struct aesd_chunk *chunk)
+{
+    *spare->large_tail = chunk;
+    spare->large_tail = &chunk->next;
+}
+
+int aesd_chunk_reserve(struct aesd_chunk_store *store, const struct aesd_buffer_entry *entries,
+        size_t count, struct aesd_chunk_spare *spare)
+{
+    size_t room = store->open ? store->open->alloc - store->open->size : 0;
+    struct aesd_chunk *chunk;
+    size_t index;
+
+    spare->regular = NULL;
+    spare->large = NULL;
+    spare->large_tail = &spare->large;
+
+    /*
+     * Plays the commit through without releasing any overwritten entries.
+     * Releases can only leave more room in the open chunk, so this never
+     * reserves less than aesd_chunk_add() takes.
+     */
+    for (index = 0; index < count; index++) {
+        size_t size = entries[index].size;
+
+        if (size > AESD_CHUNK_SIZE) {
+            chunk = aesd_chunk_alloc(store, size);
+            if (!chunk)
+                goto fail;
+            aesd_chunk_push_large(spare, chunk);
+        } else if (size > room) {
+            chunk = aesd_chunk_alloc(store, AESD_CHUNK_SIZE);
+            if (!chunk)
+                goto fail;
+            chunk->next = spare->regular;
+            spare->regular = chunk;
+            room = AESD_CHUNK_SIZE - size;
+        } else {
+            room -= size;
+        }
+    }
+    return 0;
+
+fail:
+    aesd_chunk_release_spare(spare);
+    return -ENOMEM;
+}
+
+void aesd_chunk_release_spare(struct aesd_chunk_spare *spare)
+{
+    struct aesd_chunk *chunk;
+
+    while ((chunk = spare->regular)) {
+        spare->regular = chunk->next;
+        kvfree(chunk->data);
+        kfree(chunk);
+    }
+    while ((chunk = spare->large)) {
+        spare->large = chunk->next;
+        kvfree(chunk->data);
+        kfree(chunk);
+    }
+    spare->large_tail = &spare->large;
+}
+
+void aesd_chunk_add(struct aesd_chunk_store *store, const char *data, size_t size,
+        struct aesd_chunk_ref *ref, struct aesd_chunk_spare *spare)
+{
+    struct aesd_chunk *chunk;
+
+    if (size > AESD_CHUNK_SIZE) {
+        chunk = spare->large;
+        spare->large = chunk->next;
+        if (!spare->large)
+            spare->large_tail = &spare->large;
+
+        memcpy(chunk->data, data, size);
+        chunk->size = size;
+        chunk->refs = 1;
+        ref->chunk = chunk;
+        ref->offset = 0;
+        aesd_chunk_seal(store, chunk);
+        return;
+    }
+
+    if (!store->open || store->open->alloc - store->open->size < size) {
+        if (store->open)
+            aesd_chunk_seal(store, store->open);
+        store->open = spare->regular;
+        spare->regular = store->open->next;
+        store->open->next = NULL;
+    }
+
+    chunk = store->open;
+    memcpy(chunk->data + chunk->size, data, size);
+    ref->chunk = chunk;
+    ref->offset = chunk->size;
+    chunk->size += size;
+    chunk->refs++;
+}
+
+void aesd_chunk_put(struct aesd_chunk_store *store, struct aesd_chunk_ref *ref)
+{
+    struct aesd_chunk *chunk = ref->chunk;
+
+    if (!chunk)
+        return;
+    ref->chunk = NULL;
+
+    if (--chunk->refs)
+        return;
+
+    if (chunk == store->open)
+        chunk->size = 0; // Everything in it was overwritten, start filling it again
+    else
+        aesd_chunk_free(store, chunk);
+}
+
+static const char *aesd_chunk_decompress(struct aesd_chunk_store *store, struct aesd_chunk *chunk)
+{
+#if AESD_HAVE_LZ4
+    struct aesd_chunk_cache_slot *slot = &store->cache[0];
+    int index;
+
+    for (index = 0; index < AESD_CHUNK_CACHE_SLOTS; index++) {
+        if (store->cache[index].id == chunk->id) {
+            store->cache[index].last_use = ++store->clock;
+            return store->cache[index].data;
+        }
+        if (store->cache[index].last_use < slot->last_use)
+            slot = &store->cache[index];
+    }
+
+    // Miss, reuse the least recently used slot
+    slot->id = 0;
+    if (slot->alloc < chunk->size) {
+        kvfree(slot->data);
+        slot->alloc = 0;
+        slot->data = kvmalloc(max_t(size_t, chunk->size, AESD_CHUNK_SIZE), GFP_KERNEL);
+        if (!slot->data)
+            return NULL;
+        slot->alloc = max_t(size_t, chunk->size, AESD_CHUNK_SIZE);
+    }
+
+    if (LZ4_decompress_safe(chunk->data, slot->data, chunk->stored, chunk->size) != (int)chunk->size) {
+        printk(KERN_ERR "aesdchar: corrupted chunk %llu\n", chunk->id);
+        return NULL;
+    }
+
+    slot->id = chunk->id;
+    slot->last_use = ++store->clock;
+    return slot->data;
+#else
+    return NULL;
+#endif
+}
+
+const char *aesd_chunk_data(struct aesd_chunk_store *store, const struct aesd_chunk_ref *ref)
+{
+    const char *data;
+
+    if (!ref->chunk->compressed)
+        return ref->chunk->data + ref->offset;
+
+    data = aesd_chunk_decompress(store, ref->chunk);
+    return data ? data + ref->offset : NULL;
+}
@@ -0,0 +1,113 @@
+/*
+ * aesd-chunk.h
+ *
+ * Storage for the contents of the aesdchar circular buffer entries. Small
+ * entries are packed back to back into shared page sized chunks instead of
+ * getting an allocation each, entries larger than a chunk get a chunk of
+ * their own. Once a chunk is full it is sealed and, when compression is
+ * enabled, replaced by its LZ4 compressed form; reads then go through a
+ * small cache of recently decompressed chunks.
+ *
+ * A chunk is freed when the last entry stored in it leaves the circular
+ * buffer. None of these functions lock, callers hold the device lock.
+ */
+
+#ifndef AESD_CHUNK_H
+#define AESD_CHUNK_H
+
+#include <linux/types.h>
+
+#include "aesd-circular-buffer.h"
+
+#define AESD_CHUNK_SIZE PAGE_SIZE
+#define AESD_CHUNK_CACHE_SLOTS 4
+
+struct aesd_chunk {
+    struct aesd_chunk *next;              // Link while the chunk is on a spare list
+    u64 id;                               // Unique for the life of the module, names the chunk in the cache
+    unsigned int refs;                    // Entries of the circular buffer stored in this chunk
+    size_t size;                          // Bytes of entry data
+    size_t alloc;                         // Bytes allocated for data while not compressed
+    size_t stored;                        // Bytes held in data, the compressed size once compressed
+    bool compressed;
+    char *data;
+};
+
+/*
+ * Where the contents of one circular buffer entry are stored
+ */
+struct aesd_chunk_ref {
+    struct aesd_chunk *chunk;
+    size_t offset;                        // Offset of the entry in the uncompressed chunk
+};
+
+struct aesd_chunk_cache_slot {
+    u64 id;                               // Chunk decompressed into data, 0 when empty
+    u64 last_use;
+    size_t alloc;
+    char *data;
+};
+
+/*
+ * Chunks allocated by aesd_chunk_reserve() ahead of a commit, so the commit
+ * itself cannot fail half way through
+ */
+struct aesd_chunk_spare {
+    struct aesd_chunk *regular;
+    struct aesd_chunk *large;             // One per entry larger than a chunk, in commit order
+    struct aesd_chunk **large_tail;
+};
+
+struct aesd_chunk_store {
+    struct aesd_chunk *open;              // Chunk new small entries are appended to
+    bool compress;
+    void *lz4_wrkmem;
+    u64 next_id;
+    u64 clock;
+    struct aesd_chunk_cache_slot cache[AESD_CHUNK_CACHE_SLOTS];
+};
+
+/**
+ * @param compress selects LZ4 compression of sealed chunks, ignored with a warning
+ *   when the kernel has no LZ4 support
+ * @return 0 on success, -ENOMEM
+ */
+extern int aesd_chunk_store_init(struct aesd_chunk_store *store, bool compress);
+
+/**
+ * Free the open chunk and the cache. Every entry must have been released with
+ * aesd_chunk_put() before.
+ */
+extern void aesd_chunk_store_destroy(struct aesd_chunk_store *store);
+
+/**
+ * Allocate every chunk needed to add the @param count entries at @param entries.
+ * @return 0 on success, -ENOMEM with nothing left in @param spare
+ */
+extern int aesd_chunk_reserve(struct aesd_chunk_store *store, const struct aesd_buffer_entry *entries,
+            size_t count, struct aesd_chunk_spare *spare);
+
+/**
+ * Free the chunks of @param spare that aesd_chunk_add() did not use.
+ */
+extern void aesd_chunk_release_spare(struct aesd_chunk_spare *spare);
+
+/**
+ * Copy @param size bytes at @param data into the store and set @param ref to
+ * where they went. Entries must be added in the order they were reserved.
+ */
+extern void aesd_chunk_add(struct aesd_chunk_store *store, const char *data, size_t size,
+            struct aesd_chunk_ref *ref, struct aesd_chunk_spare *spare);
+
+/**
+ * Release the entry stored at @param ref, freeing its chunk if it was the last one.
+ */
+extern void aesd_chunk_put(struct aesd_chunk_store *store, struct aesd_chunk_ref *ref);
+
+/**
+ * @return the contents of the entry stored at @param ref, valid until the next call
+ *   into the store, or NULL if its chunk could not be decompressed
+ */
+extern const char *aesd_chunk_data(struct aesd_chunk_store *store, const struct aesd_chunk_ref *ref);
+
+#endif /* AESD_CHUNK_H */
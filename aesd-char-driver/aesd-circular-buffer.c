@@ -70,3 +70,37 @@ void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer)
     memset(buffer, 0, sizeof(struct aesd_circular_buffer));
 }
 
+size_t aesd_circular_buffer_count(const struct aesd_circular_buffer *buffer)
+{
+    if (buffer->full)
+        return AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    return (buffer->in_offs + AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED - buffer->out_offs)
+        % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+}
+
+struct aesd_buffer_entry *aesd_circular_buffer_find_entry_for_key(
+    struct aesd_circular_buffer *buffer, uint64_t (*key_of)(const struct aesd_buffer_entry *entry),
+    uint64_t key, size_t *char_offset_rtn)
+{
+    size_t count = aesd_circular_buffer_count(buffer);
+    size_t low = 0, high = count;
+    size_t index;
+
+    // Positions are zero referenced from out_offs, so [low, high) never wraps
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (key_of(&buffer->entry[(buffer->out_offs + mid) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED]) < key)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    // Read offsets count from the oldest entry, add up everything before the one found
+    *char_offset_rtn = 0;
+    for (index = 0; index < low; index++)
+        *char_offset_rtn += buffer->entry[(buffer->out_offs + index) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED].size;
+
+    if (low == count)
+        return NULL;
+    return &buffer->entry[(buffer->out_offs + low) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+}
@@ -16,7 +16,14 @@
 #include <stdbool.h>
 #endif
 
+#ifndef AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED
 #define AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED 10
+#endif
+
+// in_offs and out_offs are uint8_t
+#if AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED < 1 || AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED > 255
+#error "AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED must be between 1 and 255"
+#endif
 
 struct aesd_buffer_entry
 {
@@ -28,6 +35,18 @@ struct aesd_buffer_entry
      * Number of bytes stored in buffptr
      */
     size_t size;
+    // Only the driver stamps entries, user space leaves them out unless a test of the key lookup needs them
+#if defined(__KERNEL__) || defined(AESD_BUFFER_ENTRY_STAMPS)
+    /**
+     * Sequence number of the write command, set when it is committed
+     */
+    uint64_t seq;
+    /**
+     * Commit time in nanoseconds on the monotonic and realtime clocks
+     */
+    uint64_t mono_ns;
+    uint64_t real_ns;
+#endif
 };
 
 struct aesd_circular_buffer
@@ -58,6 +77,22 @@ extern void aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer,
 
 extern void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
 
+/**
+ * @return the number of entries currently stored in @param buffer
+ */
+extern size_t aesd_circular_buffer_count(const struct aesd_circular_buffer *buffer);
+
+/**
+ * Binary search for the oldest entry whose key is at least @param key. The keys
+ * returned by @param key_of must never decrease from the oldest entry to the
+ * newest, as holds for seq, mono_ns and real_ns.
+ * @param char_offset_rtn receives the offset of the first byte of the entry found,
+ *   or the total size of the buffer when there is none
+ * @return the entry found, or NULL if every entry has a smaller key
+ */
+extern struct aesd_buffer_entry *aesd_circular_buffer_find_entry_for_key(struct aesd_circular_buffer *buffer,
+            uint64_t (*key_of)(const struct aesd_buffer_entry *entry), uint64_t key, size_t *char_offset_rtn);
+
 /**
  * Create a for loop to iterate over each member of the circular buffer.
  * Useful when you've allocated memory for circular buffer entries and need to free it
@@ -0,0 +1,146 @@
+/**
+ * @file aesd-lockfree-ring.c
+ * @brief Lock-free single and multi producer rings of aesd_buffer_entry
+ *
+ * The multi producer ring follows Dmitry Vyukov's bounded queue: every slot
+ * carries a sequence number, so producers only contend on the head counter
+ * and the consumer never needs a read-modify-write instruction.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "aesd-lockfree-ring.h"
+
+static size_t round_up_pow2(size_t capacity)
+{
+    size_t size = 1;
+
+    while (size < capacity)
+        size <<= 1;
+    return size;
+}
+
+int aesd_spsc_ring_init(struct aesd_spsc_ring *ring, size_t capacity)
+{
+    size_t size = round_up_pow2(capacity ? capacity : 1);
+
+    memset(ring, 0, sizeof(struct aesd_spsc_ring));
+    ring->entry = calloc(size, sizeof(struct aesd_buffer_entry));
+    if (!ring->entry)
+        return -1;
+    ring->mask = size - 1;
+    return 0;
+}
+
+void aesd_spsc_ring_destroy(struct aesd_spsc_ring *ring)
+{
+    free(ring->entry);
+    ring->entry = NULL;
+}
+
+bool aesd_spsc_ring_push(struct aesd_spsc_ring *ring, const struct aesd_buffer_entry *entry)
+{
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+    if (head - ring->tail_cache > ring->mask) {
+        ring->tail_cache = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        if (head - ring->tail_cache > ring->mask)
+            return false;
+    }
+
+    ring->entry[head & ring->mask] = *entry;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    return true;
+}
+
+bool aesd_spsc_ring_pop(struct aesd_spsc_ring *ring, struct aesd_buffer_entry *entry)
+{
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+    if (tail == ring->head_cache) {
+        ring->head_cache = atomic_load_explicit(&ring->head, memory_order_acquire);
+        if (tail == ring->head_cache)
+            return false;
+    }
+
+    *entry = ring->entry[tail & ring->mask];
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+    return true;
+}
+
+int aesd_mpsc_ring_init(struct aesd_mpsc_ring *ring, size_t capacity)
+{
+    size_t size = round_up_pow2(capacity ? capacity : 1);
+    size_t index;
+
+    memset(ring, 0, sizeof(struct aesd_mpsc_ring));
+    ring->slot = calloc(size, sizeof(struct aesd_mpsc_slot));
+    if (!ring->slot)
+        return -1;
+    ring->mask = size - 1;
+
+    for (index = 0; index < size; index++)
+        atomic_init(&ring->slot[index].seq, index);
+    return 0;
+}
+
+void aesd_mpsc_ring_destroy(struct aesd_mpsc_ring *ring)
+{
+    free(ring->slot);
+    ring->slot = NULL;
+}
+
+bool aesd_mpsc_ring_push(struct aesd_mpsc_ring *ring, const struct aesd_buffer_entry *entry,
+            size_t *ticket)
+{
+    size_t pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    struct aesd_mpsc_slot *slot;
+
+    for (;;) {
+        size_t seq;
+        ptrdiff_t diff;
+
+        slot = &ring->slot[pos & ring->mask];
+        seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        diff = (ptrdiff_t)(seq - pos);
+
+        if (diff == 0) {
+            // Slot is free for this position, race the other producers for it
+            if (atomic_compare_exchange_weak_explicit(&ring->head, &pos, pos + 1,
+                        memory_order_relaxed, memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            // Still holds the entry from one lap ago: full
+            return false;
+        } else {
+            pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        }
+    }
+
+    slot->entry = *entry;
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+    if (ticket)
+        *ticket = pos;
+    return true;
+}
+
+bool aesd_mpsc_ring_pop(struct aesd_mpsc_ring *ring, struct aesd_buffer_entry *entry)
+{
+    size_t pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    struct aesd_mpsc_slot *slot = &ring->slot[pos & ring->mask];
+
+    if (atomic_load_explicit(&slot->seq, memory_order_acquire) != pos + 1)
+        return false;
+
+    *entry = slot->entry;
+    // Hand the slot to the producer one lap ahead
+    atomic_store_explicit(&slot->seq, pos + ring->mask + 1, memory_order_release);
+    atomic_store_explicit(&ring->tail, pos + 1, memory_order_relaxed);
+    return true;
+}
+
+size_t aesd_mpsc_ring_tail(struct aesd_mpsc_ring *ring)
+{
+    return atomic_load_explicit(&ring->tail, memory_order_relaxed);
+}
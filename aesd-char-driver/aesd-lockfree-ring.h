@@ -0,0 +1,127 @@
+/*
+ * aesd-lockfree-ring.h
+ *
+ * User space only sibling of aesd-circular-buffer.h: bounded rings of
+ * aesd_buffer_entry descriptors which synchronize on their own, for handing
+ * entries from one or many producer threads to a single consumer thread.
+ *
+ * Unlike aesd_circular_buffer these rings never overwrite: a push into a full
+ * ring fails and the producer decides whether to retry or drop.
+ */
+
+#ifndef AESD_LOCKFREE_RING_H
+#define AESD_LOCKFREE_RING_H
+
+#ifdef __KERNEL__
+#error "aesd-lockfree-ring is only available in user space"
+#endif
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#include "aesd-circular-buffer.h"
+
+#define AESD_CACHE_LINE_SIZE 64
+
+/**
+ * Wait-free ring for exactly one producer and one consumer thread
+ */
+struct aesd_spsc_ring
+{
+    /**
+     * Next position to write, only advanced by the producer
+     */
+    _Alignas(AESD_CACHE_LINE_SIZE) atomic_size_t head;
+    /**
+     * The producer's last view of tail, saves reloading the consumer's cache line
+     */
+    size_t tail_cache;
+    /**
+     * Next position to read, only advanced by the consumer
+     */
+    _Alignas(AESD_CACHE_LINE_SIZE) atomic_size_t tail;
+    /**
+     * The consumer's last view of head
+     */
+    size_t head_cache;
+    _Alignas(AESD_CACHE_LINE_SIZE) struct aesd_buffer_entry *entry;
+    size_t mask;
+};
+
+struct aesd_mpsc_slot
+{
+    /**
+     * Position this slot is ready for: equal to it when free for a producer,
+     * one past it once the entry has been published for the consumer
+     */
+    atomic_size_t seq;
+    struct aesd_buffer_entry entry;
+};
+
+/**
+ * Lock-free ring for any number of producer threads and one consumer thread
+ */
+struct aesd_mpsc_ring
+{
+    /**
+     * Next position to claim, shared by all producers
+     */
+    _Alignas(AESD_CACHE_LINE_SIZE) atomic_size_t head;
+    /**
+     * Next position to read, only advanced by the consumer
+     */
+    _Alignas(AESD_CACHE_LINE_SIZE) atomic_size_t tail;
+    _Alignas(AESD_CACHE_LINE_SIZE) struct aesd_mpsc_slot *slot;
+    size_t mask;
+};
+
+/**
+ * Allocate a ring holding @param capacity entries, rounded up to a power of two.
+ * @return 0 on success, -1 if the allocation failed.
+ */
+extern int aesd_spsc_ring_init(struct aesd_spsc_ring *ring, size_t capacity);
+
+extern void aesd_spsc_ring_destroy(struct aesd_spsc_ring *ring);
+
+/**
+ * Producer side. @return false if the ring is full.
+ */
+extern bool aesd_spsc_ring_push(struct aesd_spsc_ring *ring, const struct aesd_buffer_entry *entry);
+
+/**
+ * Consumer side. @return false if the ring is empty, otherwise the oldest entry is
+ * removed and copied to @param entry.
+ */
+extern bool aesd_spsc_ring_pop(struct aesd_spsc_ring *ring, struct aesd_buffer_entry *entry);
+
+/**
+ * Allocate a ring holding @param capacity entries, rounded up to a power of two.
+ * @return 0 on success, -1 if the allocation failed.
+ */
+extern int aesd_mpsc_ring_init(struct aesd_mpsc_ring *ring, size_t capacity);
+
+extern void aesd_mpsc_ring_destroy(struct aesd_mpsc_ring *ring);
+
+/**
+ * Producer side, safe from any number of threads.
+ * @param ticket if not NULL, receives the position of the entry. Positions start at 0
+ *   and the consumer pops entries in position order, so it can count them to know
+ *   which producer an entry came from.
+ * @return false if the ring is full.
+ */
+extern bool aesd_mpsc_ring_push(struct aesd_mpsc_ring *ring, const struct aesd_buffer_entry *entry,
+            size_t *ticket);
+
+/**
+ * Consumer side. @return false if the ring is empty or the oldest entry is still being
+ * written by its producer, otherwise the entry is removed and copied to @param entry.
+ */
+extern bool aesd_mpsc_ring_pop(struct aesd_mpsc_ring *ring, struct aesd_buffer_entry *entry);
+
+/**
+ * @return the position the next aesd_mpsc_ring_pop() will return. Consumer side only.
+ */
+extern size_t aesd_mpsc_ring_tail(struct aesd_mpsc_ring *ring);
+
+#endif /* AESD_LOCKFREE_RING_H */
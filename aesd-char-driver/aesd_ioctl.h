@@ -33,14 +33,87 @@ struct aesd_seekto {
     uint32_t write_cmd_offset;
 };
 
+/**
+ * One complete command passed to AESDCHAR_IOCBULKCOMMIT
+ */
+struct aesd_commit_entry {
+    /**
+     * User space address of the command, cast to uint64_t
+     */
+    uint64_t buf;
+    /**
+     * Number of bytes at buf, normally ending with the command's newline
+     */
+    uint32_t size;
+    uint32_t reserved;
+};
+
+/**
+ * A structure to be passed by IOCTL to commit several commands at once. Every
+ * entry becomes one entry of the circular buffer as is, without looking for
+ * newlines, and the whole array is committed under a single lock acquisition.
+ * Commands staged by earlier partial writes on the same file are not affected.
+ */
+struct aesd_bulk_commit {
+    /**
+     * User space address of an array of struct aesd_commit_entry, cast to uint64_t
+     */
+    uint64_t entries;
+    /**
+     * Number of entries in the array, at most AESDCHAR_BULK_MAX
+     */
+    uint32_t count;
+    /**
+     * Set by the driver to the number of entries committed
+     */
+    uint32_t committed;
+};
+
+#define AESDCHAR_BULK_MAX 256
+
+enum aesd_seek_key {
+    AESD_SEEK_SEQ = 0,
+    AESD_SEEK_MONOTONIC = 1,
+    AESD_SEEK_REALTIME = 2,
+};
+
+/**
+ * A structure to be passed by IOCTL to seek to the oldest write command with a
+ * sequence number or commit time at or after a given value. When every command
+ * still in the buffer is older, the file position moves to the end so the next
+ * read returns the next new command.
+ */
+struct aesd_seekkey {
+    /**
+     * One of enum aesd_seek_key
+     */
+    uint32_t key;
+    uint32_t reserved;
+    /**
+     * Sequence number, or time in nanoseconds on the clock selected by key
+     */
+    uint64_t value;
+    /**
+     * Set by the driver to the sequence number of the command the file now points
+     * at, which is the next one to be written when seeking to the end
+     */
+    uint64_t seq;
+    /**
+     * Set by the driver to the new file position
+     */
+    uint64_t pos;
+};
+
 // Pick an arbitrary unused value from https://github.com/torvalds/linux/blob/master/Documentation/userspace-api/ioctl/ioctl-number.rst
 #define AESD_IOC_MAGIC 0x16
 
 // Define a write command from the user point of view, use command number 1
 #define AESDCHAR_IOCSEEKTO _IOWR(AESD_IOC_MAGIC, 1, struct aesd_seekto)
+#define AESDCHAR_IOCBULKCOMMIT _IOWR(AESD_IOC_MAGIC, 2, struct aesd_bulk_commit)
+#define AESDCHAR_IOCSEEKKEY _IOWR(AESD_IOC_MAGIC, 3, struct aesd_seekkey)
 /**
  * The maximum number of commands supported, used for bounds checking
  */
-#define AESDCHAR_IOC_MAXNR 1
+#define AESDCHAR_IOC_MAXNR 3
 
 #endif /* AESD_IOCTL_H */
@@ -9,6 +9,7 @@
 #define AESD_CHAR_DRIVER_AESDCHAR_H_
 
 #include "aesd-circular-buffer.h"
+#include "aesd-chunk.h"
 
 #define AESD_DEBUG 1  //Remove comment on this line to enable debug
 
@@ -27,10 +28,25 @@
 
 struct aesd_dev {
     struct aesd_circular_buffer buffer;   // Circular buffer for storing write entries
-    struct mutex lock;                    // Mutex for synchronizing access
-    char *partial_buffer;                 // Buffer for storing incomplete writes
-    size_t partial_size;                  // Size of the partial buffer
+    struct aesd_chunk_store chunks;       // Contents of the entries in buffer
+    struct aesd_chunk_ref location[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED]; // Where each entry's contents are, by slot
+    struct mutex lock;                    // Mutex for synchronizing access to buffer
+    uint64_t next_seq;                    // Sequence number of the next committed entry
+    uint64_t last_real_ns;                // Realtime stamp of the newest entry
     struct cdev cdev;                     // Character device structure
 };
 
+/*
+ * Per open file state. Writes are staged here until a newline completes the
+ * command, so writers using different files never interleave inside an entry
+ * and only take the device lock to add finished commands to the buffer.
+ */
+struct aesd_file {
+    struct aesd_dev *dev;                 // Device this file was opened on
+    struct mutex lock;                    // Serializes writers sharing this file
+    char *partial_buffer;                 // Incomplete command written so far
+    size_t partial_size;                  // Bytes used in partial_buffer
+    size_t partial_alloc;                 // Bytes allocated for partial_buffer
+};
+
 #endif /* AESD_CHAR_DRIVER_AESDCHAR_H_ */
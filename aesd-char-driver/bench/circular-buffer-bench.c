@@ -0,0 +1,212 @@
+/**
+ * @file circular-buffer-bench.c
+ * @brief Throughput and latency of aesd_circular_buffer add and lookup
+ *
+ * The ring capacity is fixed at compile time, so the Makefile builds one
+ * binary per AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED value. Each binary runs
+ * every entry size distribution against its capacity and prints one line
+ * per operation and distribution.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "aesd-circular-buffer.h"
+
+#define BENCH_OPS 1000000
+#define BENCH_SAMPLES 100000
+#define ENTRY_MAX_SIZE 4096
+
+enum size_dist {
+    DIST_FIXED,
+    DIST_UNIFORM,
+    DIST_BIMODAL,
+    DIST_COUNT,
+};
+
+static const char *const dist_names[DIST_COUNT] = {
+    [DIST_FIXED] = "fixed-64",
+    [DIST_UNIFORM] = "uniform-1-4096",
+    [DIST_BIMODAL] = "bimodal-90/10",
+};
+
+static char payload[ENTRY_MAX_SIZE];
+static volatile size_t sink;
+
+/* xorshift64*, deterministic between runs so results stay comparable */
+static unsigned long long rng_state = 0x9e3779b97f4a7c15ULL;
+
+static unsigned long long rng_next(void)
+{
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545f4914f6cdd1dULL;
+}
+
+static size_t entry_size(enum size_dist dist)
+{
+    switch (dist) {
+    case DIST_FIXED:
+        return 64;
+    case DIST_UNIFORM:
+        return 1 + rng_next() % ENTRY_MAX_SIZE;
+    case DIST_BIMODAL:
+        // Mostly short command lines with the occasional large paste
+        if (rng_next() % 10)
+            return 8 + rng_next() % 56;
+        return 2048 + rng_next() % 2048;
+    default:
+        return 1;
+    }
+}
+
+static unsigned long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int compare_ull(const void *a, const void *b)
+{
+    unsigned long long x = *(const unsigned long long *)a;
+    unsigned long long y = *(const unsigned long long *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Timing a single operation costs about as much as the operation itself, so
+ * the per sample cost of reading the clock is measured up front and removed.
+ */
+static unsigned long long clock_overhead(void)
+{
+    unsigned long long start, total = 0;
+    int i;
+
+    for (i = 0; i < BENCH_SAMPLES; i++) {
+        start = now_ns();
+        total += now_ns() - start;
+    }
+    return total / BENCH_SAMPLES;
+}
+
+static void report(const char *op, enum size_dist dist, unsigned long long elapsed,
+        unsigned long long *samples, unsigned long long overhead)
+{
+    int i;
+
+    for (i = 0; i < BENCH_SAMPLES; i++)
+        samples[i] = samples[i] > overhead ? samples[i] - overhead : 0;
+    qsort(samples, BENCH_SAMPLES, sizeof(samples[0]), compare_ull);
+
+    printf("%3d %-8s %-16s %8.1f Mops/s %7.1f ns/op  p50 %4llu ns  p99 %4llu ns  max %6llu ns\n",
+           AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED, op, dist_names[dist],
+           BENCH_OPS * 1000.0 / elapsed, (double)elapsed / BENCH_OPS,
+           samples[BENCH_SAMPLES / 2], samples[BENCH_SAMPLES * 99 / 100], samples[BENCH_SAMPLES - 1]);
+}
+
+static size_t fill(struct aesd_circular_buffer *buffer, enum size_dist dist)
+{
+    struct aesd_buffer_entry entry = { .buffptr = payload };
+    size_t total = 0;
+    int i;
+
+    aesd_circular_buffer_init(buffer);
+    for (i = 0; i < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; i++) {
+        entry.size = entry_size(dist);
+        total += entry.size;
+        aesd_circular_buffer_add_entry(buffer, &entry);
+    }
+    return total;
+}
+
+static void bench_add(enum size_dist dist, unsigned long long *samples, unsigned long long overhead)
+{
+    struct aesd_circular_buffer buffer;
+    struct aesd_buffer_entry entries[256];
+    unsigned long long start, elapsed;
+    int i;
+
+    for (i = 0; i < 256; i++) {
+        entries[i].buffptr = payload;
+        entries[i].size = entry_size(dist);
+    }
+
+    fill(&buffer, dist);
+    start = now_ns();
+    for (i = 0; i < BENCH_OPS; i++)
+        aesd_circular_buffer_add_entry(&buffer, &entries[i & 255]);
+    elapsed = now_ns() - start;
+    sink += buffer.in_offs;
+
+    for (i = 0; i < BENCH_SAMPLES; i++) {
+        start = now_ns();
+        aesd_circular_buffer_add_entry(&buffer, &entries[i & 255]);
+        samples[i] = now_ns() - start;
+    }
+
+    report("add", dist, elapsed, samples, overhead);
+}
+
+/*
+ * Offsets are uniform over the whole history, which is what lseek() followed
+ * by read() does. The cost grows with the number of entries walked.
+ */
+static void bench_find(enum size_dist dist, unsigned long long *samples, unsigned long long overhead)
+{
+    struct aesd_circular_buffer buffer;
+    struct aesd_buffer_entry *entry;
+    unsigned long long start, elapsed;
+    size_t offsets[1024];
+    size_t total, entry_offset;
+    int i;
+
+    total = fill(&buffer, dist);
+    for (i = 0; i < 1024; i++)
+        offsets[i] = rng_next() % total;
+
+    start = now_ns();
+    for (i = 0; i < BENCH_OPS; i++) {
+        entry = aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, offsets[i & 1023], &entry_offset);
+        sink += entry_offset + (entry != NULL);
+    }
+    elapsed = now_ns() - start;
+
+    for (i = 0; i < BENCH_SAMPLES; i++) {
+        start = now_ns();
+        entry = aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, offsets[i & 1023], &entry_offset);
+        samples[i] = now_ns() - start;
+        sink += entry_offset + (entry != NULL);
+    }
+
+    report("find", dist, elapsed, samples, overhead);
+}
+
+int main(void)
+{
+    unsigned long long *samples;
+    unsigned long long overhead;
+    int dist;
+
+    samples = malloc(BENCH_SAMPLES * sizeof(samples[0]));
+    if (!samples) {
+        perror("malloc");
+        return EXIT_FAILURE;
+    }
+
+    memset(payload, 'a', sizeof(payload));
+    overhead = clock_overhead();
+
+    for (dist = 0; dist < DIST_COUNT; dist++) {
+        bench_add(dist, samples, overhead);
+        bench_find(dist, samples, overhead);
+    }
+
+    free(samples);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,287 @@
+/**
+ * @file circular-buffer-fuzz.c
+ * @brief libFuzzer target checking aesd_circular_buffer against a reference model
+ *
+ * The input is a program of add and lookup operations. The model keeps the
+ * sizes of the most recent AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED entries in
+ * a plain array, and after every add the ring must agree with it on the
+ * offsets, the full flag and the entry owning every byte of the history.
+ *
+ * Built with clang -fsanitize=fuzzer this is a regular libFuzzer target.
+ * Built with -DAESD_FUZZ_STANDALONE it gets its own main(), which replays the
+ * files given on the command line or runs random programs, for compilers
+ * without libFuzzer.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "aesd-circular-buffer.h"
+
+#define CAPACITY AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED
+
+/*
+ * Every entry points at its own byte in this arena, so a lookup returning the
+ * wrong slot is caught even when two entries have the same size. Live entries
+ * never share a byte as long as the arena is larger than the ring.
+ */
+#define ARENA_SIZE 4096
+static char arena[ARENA_SIZE];
+
+/*
+ * Checking both edges of every entry after every add is quadratic in the
+ * capacity; large rings check this many entries, a different set each add.
+ */
+#define EDGE_CHECKS 8
+
+_Static_assert(ARENA_SIZE > CAPACITY, "arena must be larger than the ring");
+
+struct model {
+    size_t size[CAPACITY];
+    const char *buffptr[CAPACITY];
+    size_t count;
+    size_t adds;
+};
+
+static void check(int condition, const char *what, const struct model *model)
+{
+    if (condition)
+        return;
+    fprintf(stderr, "circular buffer mismatch after %zu adds (%zu entries): %s\n",
+            model->adds, model->count, what);
+    abort();
+}
+
+static void model_add(struct model *model, const struct aesd_buffer_entry *entry)
+{
+    if (model->count == CAPACITY) {
+        memmove(&model->size[0], &model->size[1], (CAPACITY - 1) * sizeof(model->size[0]));
+        memmove(&model->buffptr[0], &model->buffptr[1], (CAPACITY - 1) * sizeof(model->buffptr[0]));
+        model->count--;
+    }
+    model->size[model->count] = entry->size;
+    model->buffptr[model->count] = entry->buffptr;
+    model->count++;
+    model->adds++;
+}
+
+/**
+ * @return the entry owning byte @param offset of the history, -1 past the end
+ */
+static long model_find(const struct model *model, size_t offset, size_t *entry_offset)
+{
+    size_t start = 0;
+    size_t index;
+
+    for (index = 0; index < model->count; index++) {
+        if (offset < start + model->size[index]) {
+            *entry_offset = offset - start;
+            return index;
+        }
+        start += model->size[index];
+    }
+    return -1;
+}
+
+static void check_find(struct aesd_circular_buffer *buffer, const struct model *model, size_t offset)
+{
+    struct aesd_buffer_entry *entry;
+    size_t expected_offset = 0;
+    size_t entry_offset = 0;
+    long expected;
+
+    expected = model_find(model, offset, &expected_offset);
+    entry = aesd_circular_buffer_find_entry_offset_for_fpos(buffer, offset, &entry_offset);
+
+    if (expected == -1) {
+        check(entry == NULL, "lookup past the end returned an entry", model);
+        return;
+    }
+    check(entry != NULL, "lookup inside the history returned NULL", model);
+    check(entry >= &buffer->entry[0] && entry < &buffer->entry[CAPACITY],
+          "lookup returned a pointer outside the ring", model);
+    check(entry->buffptr == model->buffptr[expected], "lookup returned the wrong entry", model);
+    check(entry->size == model->size[expected], "lookup returned the wrong size", model);
+    check(entry_offset == expected_offset, "lookup returned the wrong offset in the entry", model);
+}
+
+static uint64_t key_seq(const struct aesd_buffer_entry *entry)
+{
+    return entry->seq;
+}
+
+/*
+ * Entries carry their add count as seq, so the oldest one in the model has
+ * seq adds - count.
+ */
+static void check_find_key(struct aesd_circular_buffer *buffer, const struct model *model, uint64_t key)
+{
+    struct aesd_buffer_entry *entry;
+    size_t first = model->adds - model->count;
+    size_t expected = key <= first ? 0 : key - first;
+    size_t expected_offset = 0;
+    size_t char_offset = 0;
+    size_t index;
+
+    if (expected > model->count)
+        expected = model->count;
+    for (index = 0; index < expected; index++)
+        expected_offset += model->size[index];
+
+    entry = aesd_circular_buffer_find_entry_for_key(buffer, key_seq, key, &char_offset);
+    check(char_offset == expected_offset, "key lookup returned the wrong offset", model);
+    if (expected == model->count) {
+        check(entry == NULL, "key lookup past the newest entry returned an entry", model);
+        return;
+    }
+    check(entry != NULL && entry->buffptr == model->buffptr[expected], "key lookup returned the wrong entry", model);
+}
+
+static void check_state(struct aesd_circular_buffer *buffer, const struct model *model)
+{
+    struct aesd_buffer_entry *entry;
+    size_t start = 0;
+    size_t stride = model->count > EDGE_CHECKS ? model->count / EDGE_CHECKS : 1;
+    size_t index;
+    uint8_t slot;
+    bool visited[CAPACITY];
+
+    check(buffer->in_offs == model->adds % CAPACITY, "in_offs out of step", model);
+    check(buffer->out_offs == (model->adds - model->count) % CAPACITY, "out_offs out of step", model);
+    check(buffer->full == (model->count == CAPACITY), "full flag out of step", model);
+    check(aesd_circular_buffer_count(buffer) == model->count, "count out of step", model);
+
+    // Both edges of every entry, and the first byte past the history
+    for (index = 0; index < model->count; index++) {
+        if ((index + model->adds) % stride == 0) {
+            check_find(buffer, model, start);
+            if (model->size[index] > 1)
+                check_find(buffer, model, start + model->size[index] - 1);
+        }
+        start += model->size[index];
+    }
+    check_find(buffer, model, start);
+    check_find(buffer, model, SIZE_MAX);
+    check_find_key(buffer, model, 0);
+    check_find_key(buffer, model, model->adds);
+
+    // The iterator has to visit every live entry, found by its position in the arena
+    memset(visited, 0, sizeof(visited));
+    AESD_CIRCULAR_BUFFER_FOREACH(entry, buffer, slot) {
+        size_t live;
+        if (!entry->buffptr)
+            continue;
+        live = (entry->buffptr - arena + ARENA_SIZE - (model->adds - model->count) % ARENA_SIZE) % ARENA_SIZE;
+        if (live < model->count)
+            visited[live] = true;
+    }
+    for (index = 0; index < model->count; index++) {
+        if (!visited[index])
+            break;
+    }
+    check(index == model->count, "foreach missed a live entry", model);
+}
+
+/*
+ * Each operation is one opcode byte followed by two argument bytes:
+ * even opcodes add an entry of the given size (0 to 65535), odd ones look up
+ * the given offset scaled by the opcode so lookups can land past the end, and
+ * a sequence number up to one ring behind the next one.
+ */
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    struct aesd_circular_buffer buffer;
+    struct model model;
+
+    aesd_circular_buffer_init(&buffer);
+    memset(&model, 0, sizeof(model));
+    check_state(&buffer, &model);
+
+    while (size >= 3) {
+        uint8_t op = data[0];
+        size_t arg = data[1] | (size_t)data[2] << 8;
+
+        if (op & 1) {
+            check_find(&buffer, &model, arg * (op >> 1));
+            check_find_key(&buffer, &model, model.adds - arg % (CAPACITY + 2));
+        } else {
+            struct aesd_buffer_entry entry = {
+                .buffptr = &arena[model.adds % ARENA_SIZE],
+                .size = arg,
+                .seq = model.adds,
+            };
+            aesd_circular_buffer_add_entry(&buffer, &entry);
+            model_add(&model, &entry);
+            check_state(&buffer, &model);
+        }
+
+        data += 3;
+        size -= 3;
+    }
+
+    return 0;
+}
+
+#ifdef AESD_FUZZ_STANDALONE
+
+#define STANDALONE_RUNS 2000
+#define STANDALONE_MAX_LEN 1536
+
+static int replay(const char *path)
+{
+    uint8_t *data;
+    long len;
+    FILE *file = fopen(path, "rb");
+
+    if (!file) {
+        perror(path);
+        return -1;
+    }
+    fseek(file, 0, SEEK_END);
+    len = ftell(file);
+    rewind(file);
+
+    data = malloc(len ? len : 1);
+    if (!data || fread(data, 1, len, file) != (size_t)len) {
+        perror(path);
+        free(data);
+        fclose(file);
+        return -1;
+    }
+    fclose(file);
+
+    LLVMFuzzerTestOneInput(data, len);
+    free(data);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    static uint8_t data[STANDALONE_MAX_LEN];
+    unsigned int seed = 1;
+    int run, i;
+
+    if (argc > 1) {
+        for (i = 1; i < argc; i++) {
+            if (replay(argv[i]) == -1)
+                return EXIT_FAILURE;
+        }
+        printf("replayed %d inputs\n", argc - 1);
+        return EXIT_SUCCESS;
+    }
+
+    // Small sizes make the wraparound and empty entry cases common
+    for (run = 0; run < STANDALONE_RUNS; run++) {
+        size_t len = rand_r(&seed) % STANDALONE_MAX_LEN;
+        for (i = 0; i < (int)len; i++)
+            data[i] = rand_r(&seed) % (i % 3 == 2 ? 2 : 256);
+        LLVMFuzzerTestOneInput(data, len);
+    }
+    printf("%d random programs passed\n", STANDALONE_RUNS);
+    return EXIT_SUCCESS;
+}
+
+#endif /* AESD_FUZZ_STANDALONE */
@@ -0,0 +1,167 @@
+/**
+ * @file lockfree-ring-test.c
+ * @brief Stress test of the single and multi producer rings
+ *
+ * Producers tag every entry with their index in buffptr and a running count
+ * in size. The consumer checks that each producer's entries arrive exactly
+ * once and in the order they were pushed, whatever the interleaving. Small
+ * rings keep them full most of the time, so the wrap around and full cases
+ * get exercised as much as the fast path. Built with -fsanitize=thread by the
+ * Makefile, which also catches missing barriers on the way.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "aesd-lockfree-ring.h"
+
+#define PRODUCERS 4
+#define ENTRIES_PER_PRODUCER 200000
+#define SPSC_ENTRIES 1000000
+#define RING_CAPACITY 16
+
+static struct aesd_spsc_ring spsc;
+static struct aesd_mpsc_ring mpsc;
+
+static void check(int condition, const char *what)
+{
+    if (condition)
+        return;
+    fprintf(stderr, "lockfree-ring-test: %s\n", what);
+    exit(EXIT_FAILURE);
+}
+
+static struct aesd_buffer_entry tagged(uintptr_t producer, size_t count)
+{
+    struct aesd_buffer_entry entry = { .buffptr = (const char *)producer, .size = count };
+
+    return entry;
+}
+
+static void test_spsc_full(void)
+{
+    struct aesd_buffer_entry entry = tagged(0, 0);
+    size_t count;
+
+    // Capacities round up to a power of two
+    check(aesd_spsc_ring_init(&spsc, RING_CAPACITY - 1) == 0, "spsc init failed");
+    check(!aesd_spsc_ring_pop(&spsc, &entry), "pop from an empty spsc ring succeeded");
+    for (count = 0; count < RING_CAPACITY; count++)
+        check(aesd_spsc_ring_push(&spsc, &entry), "push into a spsc ring with room failed");
+    check(!aesd_spsc_ring_push(&spsc, &entry), "push into a full spsc ring succeeded");
+    check(aesd_spsc_ring_pop(&spsc, &entry), "pop from a full spsc ring failed");
+    check(aesd_spsc_ring_push(&spsc, &entry), "push after a pop failed");
+    aesd_spsc_ring_destroy(&spsc);
+}
+
+static void *spsc_producer(void *arg)
+{
+    size_t count;
+
+    for (count = 0; count < SPSC_ENTRIES; count++) {
+        struct aesd_buffer_entry entry = tagged(0, count);
+
+        while (!aesd_spsc_ring_push(&spsc, &entry))
+            sched_yield();
+    }
+    return NULL;
+}
+
+static void test_spsc(void)
+{
+    struct aesd_buffer_entry entry;
+    pthread_t producer;
+    size_t expected = 0;
+
+    check(aesd_spsc_ring_init(&spsc, RING_CAPACITY) == 0, "spsc init failed");
+    check(pthread_create(&producer, NULL, spsc_producer, NULL) == 0, "pthread_create failed");
+    while (expected < SPSC_ENTRIES) {
+        if (!aesd_spsc_ring_pop(&spsc, &entry)) {
+            sched_yield();
+            continue;
+        }
+        check(entry.size == expected, "spsc entry lost, duplicated or reordered");
+        expected++;
+    }
+    pthread_join(producer, NULL);
+    check(!aesd_spsc_ring_pop(&spsc, &entry), "spsc ring not empty after the last entry");
+    aesd_spsc_ring_destroy(&spsc);
+}
+
+static void test_mpsc_full(void)
+{
+    struct aesd_buffer_entry entry = tagged(0, 0);
+    size_t count, ticket;
+
+    check(aesd_mpsc_ring_init(&mpsc, RING_CAPACITY - 1) == 0, "mpsc init failed");
+    check(!aesd_mpsc_ring_pop(&mpsc, &entry), "pop from an empty mpsc ring succeeded");
+    for (count = 0; count < RING_CAPACITY; count++) {
+        check(aesd_mpsc_ring_push(&mpsc, &entry, &ticket), "push into a mpsc ring with room failed");
+        check(ticket == count, "mpsc tickets are not consecutive");
+    }
+    check(!aesd_mpsc_ring_push(&mpsc, &entry, NULL), "push into a full mpsc ring succeeded");
+    check(aesd_mpsc_ring_pop(&mpsc, &entry), "pop from a full mpsc ring failed");
+    check(aesd_mpsc_ring_tail(&mpsc) == 1, "mpsc tail did not advance");
+    check(aesd_mpsc_ring_push(&mpsc, &entry, &ticket) && ticket == RING_CAPACITY, "push after a pop failed");
+    aesd_mpsc_ring_destroy(&mpsc);
+}
+
+static void *mpsc_producer(void *arg)
+{
+    uintptr_t producer = (uintptr_t)arg;
+    size_t count;
+
+    for (count = 0; count < ENTRIES_PER_PRODUCER; count++) {
+        struct aesd_buffer_entry entry = tagged(producer, count);
+
+        while (!aesd_mpsc_ring_push(&mpsc, &entry, NULL))
+            sched_yield();
+    }
+    return NULL;
+}
+
+static void test_mpsc(void)
+{
+    struct aesd_buffer_entry entry;
+    pthread_t producers[PRODUCERS];
+    size_t expected[PRODUCERS] = { 0 };
+    size_t popped = 0;
+    uintptr_t producer;
+
+    check(aesd_mpsc_ring_init(&mpsc, RING_CAPACITY) == 0, "mpsc init failed");
+    for (producer = 0; producer < PRODUCERS; producer++)
+        check(pthread_create(&producers[producer], NULL, mpsc_producer, (void *)producer) == 0,
+              "pthread_create failed");
+
+    while (popped < PRODUCERS * ENTRIES_PER_PRODUCER) {
+        if (!aesd_mpsc_ring_pop(&mpsc, &entry)) {
+            sched_yield();
+            continue;
+        }
+        producer = (uintptr_t)entry.buffptr;
+        check(producer < PRODUCERS, "mpsc entry from an unknown producer");
+        check(entry.size == expected[producer], "mpsc entry lost, duplicated or reordered");
+        expected[producer]++;
+        popped++;
+        check(aesd_mpsc_ring_tail(&mpsc) == popped, "mpsc tail out of step");
+    }
+
+    for (producer = 0; producer < PRODUCERS; producer++)
+        pthread_join(producers[producer], NULL);
+    check(!aesd_mpsc_ring_pop(&mpsc, &entry), "mpsc ring not empty after the last entry");
+    aesd_mpsc_ring_destroy(&mpsc);
+}
+
+int main(void)
+{
+    test_spsc_full();
+    test_spsc();
+    test_mpsc_full();
+    test_mpsc();
+    printf("lockfree-ring-test: %d spsc and %d mpsc entries from %d producers passed\n",
+           SPSC_ENTRIES, PRODUCERS * ENTRIES_PER_PRODUCER, PRODUCERS);
+    return EXIT_SUCCESS;
+}
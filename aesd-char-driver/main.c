@@ -19,35 +19,69 @@
 #include <linux/fs.h>
 #include <linux/slab.h>
 #include <linux/uaccess.h> // for copy_to_user and copy_from_user
+#include <linux/uio.h>
+#include <linux/string.h>
+#include <linux/err.h>
+#include <linux/kernel.h>
+#include <linux/ktime.h>
+#include <linux/timekeeping.h>
+#include <linux/moduleparam.h>
 
 #include "aesdchar.h"
 #include "aesd_ioctl.h"
 
+#define AESD_PARTIAL_MIN_SIZE 128
+#define AESD_MAX_DEVICES 16
+
 int aesd_major = 0; // use dynamic major
 int aesd_minor = 0;
 
 MODULE_AUTHOR("santanamobile");
 MODULE_LICENSE("Dual BSD/GPL");
 
-struct aesd_dev aesd_device;
+static bool compress = false;
+module_param(compress, bool, 0444);
+MODULE_PARM_DESC(compress, "LZ4 compress the history once a chunk of it is full");
+
+static unsigned int devices = 1;
+module_param(devices, uint, 0444);
+MODULE_PARM_DESC(devices, "Number of independent aesdchar minors, each with its own history");
+
+struct aesd_dev *aesd_devices;
 
 int aesd_open(struct inode *inode, struct file *filp)
 {
+    struct aesd_file *file;
+
     PDEBUG("open");
-    filp->private_data = &aesd_device; // for use by other operations
+    file = kzalloc(sizeof(struct aesd_file), GFP_KERNEL);
+    if (!file)
+        return -ENOMEM;
+
+    file->dev = container_of(inode->i_cdev, struct aesd_dev, cdev);
+    mutex_init(&file->lock);
+    filp->private_data = file; // for use by other operations
     return 0;
 }
 
 int aesd_release(struct inode *inode, struct file *filp)
 {
+    struct aesd_file *file = filp->private_data;
+
     PDEBUG("release");
+    // A command without its terminating newline is never committed
+    kfree(file->partial_buffer);
+    mutex_destroy(&file->lock);
+    kfree(file);
     return 0;
 }
 
 ssize_t aesd_read(struct file *filp, char __user *buf, size_t count, loff_t *f_pos)
 {
-    struct aesd_dev *dev = filp->private_data;
+    struct aesd_file *file = filp->private_data;
+    struct aesd_dev *dev = file->dev;
     struct aesd_buffer_entry *entry;
+    const char *data;
     size_t entry_offset;
     ssize_t bytes_copied = 0;
     ssize_t retval = 0;
@@ -67,7 +101,13 @@ ssize_t aesd_read(struct file *filp, char __user *buf, size_t count, loff_t *f_p
     if (bytes_copied > count)
         bytes_copied = count;
 
-    if (copy_to_user(buf, entry->buffptr + entry_offset, bytes_copied)) {
+    data = aesd_chunk_data(&dev->chunks, &dev->location[entry - dev->buffer.entry]);
+    if (!data) {
+        retval = -EIO;
+        goto out;
+    }
+
+    if (copy_to_user(buf, data + entry_offset, bytes_copied)) {
         retval = -EFAULT;
         goto out;
     }
@@ -80,64 +120,158 @@ out:
     return retval;
 }
 
-ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count, loff_t *f_pos)
+/**
+ * Grow the staging area of @param file to hold at least @param size bytes.
+ */
+static int aesd_reserve(struct aesd_file *file, size_t size)
 {
-    ssize_t retval = -ENOMEM;
-    char *kernel_buffer = NULL;
-    // const char *entry_to_free = NULL;
-    size_t newline_offset;
-    struct aesd_dev *dev = filp->private_data;
+    size_t alloc = file->partial_alloc ? file->partial_alloc : AESD_PARTIAL_MIN_SIZE;
+    char *buffer;
 
-    if (!dev)
-        return -EFAULT;
+    if (size <= file->partial_alloc)
+        return 0;
+    if (size > MAX_RW_COUNT)
+        return -EFBIG;
 
-    // Allocate temporary kernel buffer for incoming write data
-    kernel_buffer = kmalloc(count, GFP_KERNEL);
-    if (!kernel_buffer)
+    while (alloc < size)
+        alloc *= 2;
+
+    buffer = krealloc(file->partial_buffer, alloc, GFP_KERNEL);
+    if (!buffer)
         return -ENOMEM;
 
-    // Copy data from user-space to kernel-space
-    if (copy_from_user(kernel_buffer, buf, count)) {
-        retval = -EFAULT;
-        goto out_free;
+    file->partial_buffer = buffer;
+    file->partial_alloc = alloc;
+    return 0;
+}
+
+/**
+ * Add @param count entries to the circular buffer under a single acquisition of
+ * the device lock. The contents of the entries are copied into the chunk store,
+ * so they remain owned by the caller.
+ */
+static int aesd_commit_entries(struct aesd_dev *dev, const struct aesd_buffer_entry *entries, size_t count)
+{
+    struct aesd_chunk_spare spare;
+    size_t index;
+    int retval;
+
+    if (mutex_lock_interruptible(&dev->lock))
+        return -ERESTARTSYS;
+
+    // Allocate up front so the commit goes in completely or not at all
+    retval = aesd_chunk_reserve(&dev->chunks, entries, count, &spare);
+    if (retval)
+        goto unlock;
+
+    for (index = 0; index < count; index++) {
+        struct aesd_buffer_entry entry = {
+            .size = entries[index].size,
+        };
+        uint8_t slot = dev->buffer.in_offs;
+
+        // Stamped under the lock so all three keys keep the order of the buffer
+        entry.seq = dev->next_seq++;
+        entry.mono_ns = ktime_get_ns();
+        // Seeking by time needs sorted stamps, so a clock stepped backwards does not go below the last one
+        entry.real_ns = max(ktime_get_real_ns(), dev->last_real_ns);
+        dev->last_real_ns = entry.real_ns;
+
+        if (dev->buffer.full)
+            aesd_chunk_put(&dev->chunks, &dev->location[slot]);
+        aesd_chunk_add(&dev->chunks, entries[index].buffptr, entry.size, &dev->location[slot], &spare);
+        aesd_circular_buffer_add_entry(&dev->buffer, &entry);
     }
 
-    // Lock the device for thread-safe access
-    if (mutex_lock_interruptible(&dev->lock)) {
-        retval = -ERESTARTSYS;
-        goto out_free;
+    aesd_chunk_release_spare(&spare);
+
+unlock:
+    mutex_unlock(&dev->lock);
+    return retval;
+}
+
+/**
+ * Commit every complete command staged in @param file, leaving the trailing
+ * incomplete one staged. Only bytes from @param scan_from on can hold a newline
+ * not seen before. Called with file->lock held; either all complete commands are
+ * committed or the staging area is left untouched.
+ */
+static int aesd_commit_partial(struct aesd_file *file, size_t scan_from)
+{
+    struct aesd_buffer_entry *entries;
+    const char *staged = file->partial_buffer;
+    size_t count = 0, index = 0, start = 0, offset;
+    int retval;
+
+    for (offset = scan_from; offset < file->partial_size; offset++) {
+        if (staged[offset] == '\n')
+            count++;
     }
+    if (!count)
+        return 0;
 
-    // Handle case where newline is found in the incoming data
-    for (newline_offset = 0; newline_offset < count; newline_offset++) {
-        dev->partial_buffer[dev->partial_size++] = kernel_buffer[newline_offset];
-        if (kernel_buffer[newline_offset] == '\n') {
-            struct aesd_buffer_entry new_entry = {
-                .buffptr = dev->partial_buffer,
-                .size = dev->partial_size,
-            };
-            aesd_circular_buffer_add_entry(&dev->buffer, &new_entry);
-            // entry_to_free = aesd_circular_buffer_add_entry(&dev->buffer, &new_entry);
-            // if (entry_to_free)
-                // kfree(entry_to_free);
-
-            dev->partial_buffer = kmalloc(PAGE_SIZE, GFP_KERNEL);
-            if (!dev->partial_buffer) {
-                retval = -ENOMEM;
-                goto unlock;
-            }
-            dev->partial_size = 0;
-        }
+    entries = kmalloc_array(count, sizeof(struct aesd_buffer_entry), GFP_KERNEL);
+    if (!entries)
+        return -ENOMEM;
+
+    // The commit copies the commands straight out of the staging area
+    for (offset = scan_from; offset < file->partial_size; offset++) {
+        if (staged[offset] != '\n')
+            continue;
+
+        entries[index].buffptr = staged + start;
+        entries[index].size = offset + 1 - start;
+        index++;
+        start = offset + 1;
+    }
+
+    retval = aesd_commit_entries(file->dev, entries, count);
+    if (!retval) {
+        memmove(file->partial_buffer, staged + start, file->partial_size - start);
+        file->partial_size -= start;
+    }
+
+    kfree(entries);
+    return retval;
+}
+
+/**
+ * write() and writev() both end up here, so a vector of many commands is
+ * staged with one copy and committed with one acquisition of the device lock.
+ */
+ssize_t aesd_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+    struct aesd_file *file = iocb->ki_filp->private_data;
+    size_t count = iov_iter_count(from);
+    size_t staged;
+    ssize_t retval;
+
+    if (mutex_lock_interruptible(&file->lock))
+        return -ERESTARTSYS;
+
+    // Stage the data without holding the device lock
+    staged = file->partial_size;
+    retval = aesd_reserve(file, staged + count);
+    if (retval)
+        goto unlock;
+
+    if (copy_from_iter(file->partial_buffer + staged, count, from) != count) {
+        retval = -EFAULT;
+        goto unlock;
+    }
+    file->partial_size += count;
+
+    retval = aesd_commit_partial(file, staged);
+    if (retval) {
+        // Nothing was committed, drop this write so a restart does not stage it twice
+        file->partial_size = staged;
+        goto unlock;
     }
 
     retval = count;
 
 unlock:
-    mutex_unlock(&dev->lock);
-
-out_free:
-    if (kernel_buffer)
-        kfree(kernel_buffer);
+    mutex_unlock(&file->lock);
     return retval;
 }
 
@@ -145,11 +279,8 @@ loff_t aesd_llseek(struct file *filp, loff_t off, int whence)
 {
     loff_t new_pos = 0;
     int i = 0;
-    struct aesd_dev *dev = filp->private_data;
-
-    if (!dev) {
-        return -EINVAL; // Invalid argument
-    }
+    struct aesd_file *file = filp->private_data;
+    struct aesd_dev *dev = file->dev;
 
     // Use mutex to protect access
     if (mutex_lock_interruptible(&dev->lock)) {
@@ -192,35 +323,223 @@ loff_t aesd_llseek(struct file *filp, loff_t off, int whence)
     return new_pos;
 }
 
+static long aesd_seekto(struct file *filp, struct aesd_seekto __user *arg)
+{
+    struct aesd_file *file = filp->private_data;
+    struct aesd_dev *dev = file->dev;
+    struct aesd_seekto seekto;
+    struct aesd_buffer_entry *entry = NULL;
+    loff_t new_pos = 0;
+    uint8_t index;
+    uint32_t cmd;
+    long retval = -EINVAL;
+
+    if (copy_from_user(&seekto, arg, sizeof(seekto)))
+        return -EFAULT;
+    if (seekto.write_cmd >= AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED)
+        return -EINVAL;
+
+    if (mutex_lock_interruptible(&dev->lock))
+        return -ERESTARTSYS;
+
+    for (cmd = 0; cmd <= seekto.write_cmd; cmd++) {
+        index = (dev->buffer.out_offs + cmd) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+        if (index == dev->buffer.in_offs && !dev->buffer.full)
+            goto unlock; // Fewer commands than write_cmd in the buffer
+        entry = &dev->buffer.entry[index];
+        if (cmd < seekto.write_cmd)
+            new_pos += entry->size;
+    }
+
+    if (seekto.write_cmd_offset >= entry->size)
+        goto unlock;
+
+    filp->f_pos = new_pos + seekto.write_cmd_offset;
+    retval = 0;
+
+unlock:
+    mutex_unlock(&dev->lock);
+    return retval;
+}
+
+static long aesd_bulk_commit(struct file *filp, struct aesd_bulk_commit __user *arg)
+{
+    struct aesd_file *file = filp->private_data;
+    struct aesd_bulk_commit bulk;
+    struct aesd_commit_entry *commands;
+    struct aesd_buffer_entry *entries;
+    uint32_t index = 0;
+    long retval;
+
+    if (copy_from_user(&bulk, arg, sizeof(bulk)))
+        return -EFAULT;
+    if (bulk.count == 0 || bulk.count > AESDCHAR_BULK_MAX)
+        return -EINVAL;
+
+    commands = memdup_user(u64_to_user_ptr(bulk.entries), bulk.count * sizeof(struct aesd_commit_entry));
+    if (IS_ERR(commands))
+        return PTR_ERR(commands);
+
+    entries = kcalloc(bulk.count, sizeof(struct aesd_buffer_entry), GFP_KERNEL);
+    if (!entries) {
+        retval = -ENOMEM;
+        goto out_commands;
+    }
+
+    // Copy every command in before taking the device lock
+    for (index = 0; index < bulk.count; index++) {
+        char *buffer;
+
+        if (commands[index].size == 0 || commands[index].size > MAX_RW_COUNT) {
+            retval = -EINVAL;
+            goto out_free;
+        }
+        buffer = memdup_user(u64_to_user_ptr(commands[index].buf), commands[index].size);
+        if (IS_ERR(buffer)) {
+            retval = PTR_ERR(buffer);
+            goto out_free;
+        }
+        entries[index].buffptr = buffer;
+        entries[index].size = commands[index].size;
+    }
+
+    retval = aesd_commit_entries(file->dev, entries, bulk.count);
+    if (retval)
+        goto out_free;
+
+    bulk.committed = bulk.count;
+    if (put_user(bulk.committed, &arg->committed))
+        retval = -EFAULT;
+
+out_free:
+    while (index > 0)
+        kfree(entries[--index].buffptr);
+    kfree(entries);
+out_commands:
+    kfree(commands);
+    return retval;
+}
+
+static uint64_t aesd_key_seq(const struct aesd_buffer_entry *entry)
+{
+    return entry->seq;
+}
+
+static uint64_t aesd_key_monotonic(const struct aesd_buffer_entry *entry)
+{
+    return entry->mono_ns;
+}
+
+static uint64_t aesd_key_realtime(const struct aesd_buffer_entry *entry)
+{
+    return entry->real_ns;
+}
+
+static long aesd_seekkey(struct file *filp, struct aesd_seekkey __user *arg)
+{
+    struct aesd_file *file = filp->private_data;
+    struct aesd_dev *dev = file->dev;
+    struct aesd_seekkey seekkey;
+    struct aesd_buffer_entry *entry;
+    uint64_t (*key_of)(const struct aesd_buffer_entry *entry);
+    size_t new_pos;
+
+    if (copy_from_user(&seekkey, arg, sizeof(seekkey)))
+        return -EFAULT;
+
+    switch (seekkey.key) {
+    case AESD_SEEK_SEQ:
+        key_of = aesd_key_seq;
+        break;
+    case AESD_SEEK_MONOTONIC:
+        key_of = aesd_key_monotonic;
+        break;
+    case AESD_SEEK_REALTIME:
+        key_of = aesd_key_realtime;
+        break;
+    default:
+        return -EINVAL;
+    }
+
+    if (mutex_lock_interruptible(&dev->lock))
+        return -ERESTARTSYS;
+
+    entry = aesd_circular_buffer_find_entry_for_key(&dev->buffer, key_of, seekkey.value, &new_pos);
+    seekkey.seq = entry ? entry->seq : dev->next_seq;
+    seekkey.pos = new_pos;
+    filp->f_pos = new_pos;
+
+    mutex_unlock(&dev->lock);
+
+    if (copy_to_user(arg, &seekkey, sizeof(seekkey)))
+        return -EFAULT;
+    return 0;
+}
+
+long aesd_unlocked_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+    if (_IOC_TYPE(cmd) != AESD_IOC_MAGIC || _IOC_NR(cmd) > AESDCHAR_IOC_MAXNR)
+        return -ENOTTY;
+
+    switch (cmd) {
+    case AESDCHAR_IOCSEEKTO:
+        return aesd_seekto(filp, (struct aesd_seekto __user *)arg);
+    case AESDCHAR_IOCBULKCOMMIT:
+        return aesd_bulk_commit(filp, (struct aesd_bulk_commit __user *)arg);
+    case AESDCHAR_IOCSEEKKEY:
+        return aesd_seekkey(filp, (struct aesd_seekkey __user *)arg);
+    default:
+        return -ENOTTY;
+    }
+}
+
 struct file_operations aesd_fops = {
     .owner = THIS_MODULE,
     .read = aesd_read,
-    .write = aesd_write,
+    .write_iter = aesd_write_iter,
     .open = aesd_open,
     .release = aesd_release,
     .llseek = aesd_llseek,
+    .unlocked_ioctl = aesd_unlocked_ioctl,
 };
 
-static int aesd_setup_cdev(struct aesd_dev *dev)
+static int aesd_setup_cdev(struct aesd_dev *dev, unsigned int index)
 {
-    int err, devno = MKDEV(aesd_major, aesd_minor);
+    int err, devno = MKDEV(aesd_major, aesd_minor + index);
 
     cdev_init(&dev->cdev, &aesd_fops);
     dev->cdev.owner = THIS_MODULE;
     dev->cdev.ops = &aesd_fops;
     err = cdev_add(&dev->cdev, devno, 1);
     if (err)
-        printk(KERN_ERR "Error %d adding aesd cdev", err);
+        printk(KERN_ERR "Error %d adding aesd cdev %u", err, index);
 
     return err;
 }
 
+static void aesd_cleanup_device(struct aesd_dev *dev)
+{
+    uint8_t index;
+
+    // Release the contents of every entry before the store goes away
+    for (index = 0; index < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; index++)
+        aesd_chunk_put(&dev->chunks, &dev->location[index]);
+    aesd_chunk_store_destroy(&dev->chunks);
+    mutex_destroy(&dev->lock);
+}
+
 int aesd_init_module(void)
 {
     dev_t dev = 0;
+    unsigned int index;
     int result;
 
-    result = alloc_chrdev_region(&dev, aesd_minor, 1, "aesdchar");
+    if (devices < 1 || devices > AESD_MAX_DEVICES) {
+        printk(KERN_WARNING "aesdchar: devices must be between 1 and %d\n", AESD_MAX_DEVICES);
+        return -EINVAL;
+    }
+
+    result = alloc_chrdev_region(&dev, aesd_minor, devices, "aesdchar");
 
     aesd_major = MAJOR(dev);
     if (result < 0) {
@@ -228,41 +547,56 @@ int aesd_init_module(void)
         return result;
     }
 
-    memset(&aesd_device, 0, sizeof(struct aesd_dev));
-    aesd_circular_buffer_init(&aesd_device.buffer);
-    mutex_init(&aesd_device.lock);
+    aesd_devices = kcalloc(devices, sizeof(struct aesd_dev), GFP_KERNEL);
+    if (!aesd_devices) {
+        unregister_chrdev_region(dev, devices);
+        return -ENOMEM;
+    }
+
+    // Every minor is a separate history with its own lock, so channels never contend
+    for (index = 0; index < devices; index++) {
+        struct aesd_dev *aesd_device = &aesd_devices[index];
 
-    aesd_device.partial_buffer = kmalloc(PAGE_SIZE, GFP_KERNEL);
+        aesd_circular_buffer_init(&aesd_device->buffer);
+        mutex_init(&aesd_device->lock);
 
-    if (!aesd_device.partial_buffer)
-        result = -ENOMEM;
+        result = aesd_chunk_store_init(&aesd_device->chunks, compress);
+        if (result) {
+            mutex_destroy(&aesd_device->lock);
+            goto fail;
+        }
 
-    result = aesd_setup_cdev(&aesd_device);
+        result = aesd_setup_cdev(aesd_device, index);
+        if (result) {
+            aesd_cleanup_device(aesd_device);
+            goto fail;
+        }
+    }
 
-    if (result)
-        unregister_chrdev_region(dev, 1);
+    return 0;
 
+fail:
+    while (index--) {
+        cdev_del(&aesd_devices[index].cdev);
+        aesd_cleanup_device(&aesd_devices[index]);
+    }
+    kfree(aesd_devices);
+    unregister_chrdev_region(dev, devices);
     return result;
 }
 
 void aesd_cleanup_module(void)
 {
     dev_t devno = MKDEV(aesd_major, aesd_minor);
+    unsigned int index;
 
-    cdev_del(&aesd_device.cdev);
-
-    // Free all allocated buffers in the circular buffer
-    struct aesd_buffer_entry *entry;
-    uint8_t index;
-
-    AESD_CIRCULAR_BUFFER_FOREACH(entry, &aesd_device.buffer, index) {
-        if (entry->buffptr)
-            kfree(entry->buffptr);
+    for (index = 0; index < devices; index++) {
+        cdev_del(&aesd_devices[index].cdev);
+        aesd_cleanup_device(&aesd_devices[index]);
     }
+    kfree(aesd_devices);
 
-    kfree(aesd_device.partial_buffer);
-    unregister_chrdev_region(devno, 1);
-    mutex_destroy(&aesd_device.lock);
+    unregister_chrdev_region(devno, devices);
 }
 
 module_init(aesd_init_module);
@@ -1,11 +1,17 @@
+#define _GNU_SOURCE
 #include <sys/wait.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <spawn.h>
 
 #include "systemcalls.h"
 
+extern char **environ;
+
 /**
  * @param cmd the command to execute with system()
  * @return true if the command in @param cmd was executed
@@ -18,11 +24,73 @@ bool do_system(const char *cmd)
 
     int st = system(cmd);
 
+    // With no command system() only reports whether a shell is available
+    if (cmd == NULL) {
+        return st != 0;
+    }
+
     if (st == -1) {
         return false;
-    } else {
-        return true;
     }
+
+    return WIFEXITED(st) && WEXITSTATUS(st) == 0;
+}
+
+/**
+ * Start @param argv without duplicating the address space of the caller, the
+ * way fork() does. posix_spawn() runs the child on the parent's memory until
+ * it execs, so the cost no longer grows with the size of the parent.
+ * @param outputfile when not NULL, is truncated and becomes the standard output
+ * @return the pid of the child, or -1 with errno set
+ */
+static pid_t spawn_command(char *const argv[], const char *outputfile)
+{
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    pid_t pid;
+    int rc;
+
+    posix_spawn_file_actions_init(&actions);
+    posix_spawnattr_init(&attr);
+
+    if (outputfile) {
+        rc = posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, outputfile,
+                                              O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (rc != 0) {
+            goto out;
+        }
+    }
+
+#ifdef POSIX_SPAWN_USEVFORK
+    // Implied by recent glibc, older ones only skip the page table copy when asked
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_USEVFORK);
+#endif
+
+    rc = posix_spawn(&pid, argv[0], &actions, &attr, argv, environ);
+
+out:
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+
+    if (rc != 0) {
+        errno = rc;
+        return -1;
+    }
+    return pid;
+}
+
+static bool wait_command(pid_t pid)
+{
+    int status;
+
+    while (waitpid(pid, &status, 0) == -1) {
+        if (errno != EINTR) {
+            perror("Error during waitpid");
+            return false;
+        }
+    }
+
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
 }
 
 /**
@@ -60,32 +128,13 @@ bool do_exec(int count, ...)
 
     va_end(args);
 
-    pid_t pid = fork();
+    pid_t pid = spawn_command(command, NULL);
     if (pid == -1) {
-        perror("Error during fork");
+        perror("Error executing command");
         return false;
     }
 
-    if (pid == 0) {
-        if (execv(command[0], command) == -1) {
-            perror("Error executing command");
-            exit(EXIT_FAILURE);
-        }
-    } else {
-        int status;
-        if (waitpid(pid, &status, 0) == -1) {
-            perror("Error during waitpid");
-            return false;
-        }
-
-        if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
-            return true;
-        } else {
-            return false;
-        }
-    }
-
-    return false;
+    return wait_command(pid);
 
 }
 
@@ -112,32 +161,174 @@ bool do_exec_redirect(const char *outputfile, int count, ...)
 
     va_end(args);
 
-    pid_t pid = fork();
+    // Keep what the caller already printed ahead of the output of the command
+    fflush(stdout);
+
+    pid_t pid = spawn_command(command, outputfile);
     if (pid == -1) {
-        perror("Error during fork");
+        perror("Error executing command");
         return false;
     }
 
-    if (pid == 0) {
-        int fd = open(outputfile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-        if (fd == -1) {
-            perror("Error opening output file");
-            exit(1);
+    return wait_command(pid);
+}
+
+struct running_command {
+    pid_t pid;
+    int pidfd;
+    size_t index;
+};
+
+static int pidfd_open_child(pid_t pid)
+{
+#ifdef SYS_pidfd_open
+    return syscall(SYS_pidfd_open, pid, 0);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+/*
+ * Reap the command in @param slot, whose pidfd reported it exited or which is
+ * waited for directly on kernels without pidfds
+ */
+static void reap_command(struct exec_command *commands, struct running_command *slot)
+{
+    int status;
+
+    while (waitpid(slot->pid, &status, 0) == -1) {
+        if (errno != EINTR) {
+            perror("Error during waitpid");
+            status = -1;
+            break;
         }
+    }
+    commands[slot->index].status = status;
 
-        dup2(fd, STDOUT_FILENO);
-        close(fd);
-
-        execv(command[0], command);
-        perror("Error: execv failed.");
-        exit(1);
-    } else {
-        int status;
-        waitpid(pid, &status, 0);
-        if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
-            return true;
-        } else {
-            return false;
+    if (slot->pidfd != -1) {
+        close(slot->pidfd);
+    }
+}
+
+/**
+* @param commands - The @param count commands to run, each with its own arguments and
+*   optional output file as for do_exec_redirect. Their status fields are filled in.
+* @param max_parallel - How many commands may run at the same time, 0 for one per online CPU.
+*   Each finished command is replaced by the next one right away, the exits are collected
+*   through a pidfd per command and a single epoll instance.
+* @return true if every command was started and exited with status 0, false otherwise.
+*/
+bool do_exec_batch(struct exec_command *commands, size_t count, size_t max_parallel)
+{
+    struct running_command *running;
+    struct epoll_event events[16];
+    size_t next = 0, active = 0, i;
+    bool success = true;
+    int epoll_fd;
+
+    if (max_parallel == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        max_parallel = cpus > 0 ? cpus : 1;
+    }
+    if (max_parallel > count) {
+        max_parallel = count;
+    }
+    if (count == 0) {
+        return true;
+    }
+
+    running = calloc(max_parallel, sizeof(struct running_command));
+    if (!running) {
+        perror("Error during calloc");
+        return false;
+    }
+
+    // Without an epoll instance every command is waited for in the order it started
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+
+    fflush(stdout);
+
+    while (next < count || active > 0) {
+        // Fill every free slot
+        while (next < count && active < max_parallel) {
+            struct running_command *slot = &running[active];
+
+            commands[next].status = -1;
+            slot->pid = spawn_command(commands[next].argv, commands[next].outputfile);
+            if (slot->pid == -1) {
+                perror("Error executing command");
+                success = false;
+                next++;
+                continue;
+            }
+
+            slot->index = next++;
+            slot->pidfd = epoll_fd != -1 ? pidfd_open_child(slot->pid) : -1;
+            if (slot->pidfd != -1) {
+                struct epoll_event ev = {
+                    .events = EPOLLIN,
+                    .data.u64 = slot->pid,
+                };
+                if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, slot->pidfd, &ev) == -1) {
+                    close(slot->pidfd);
+                    slot->pidfd = -1;
+                }
+            }
+            active++;
+        }
+
+        if (active == 0) {
+            break;
+        }
+
+        // Commands without a pidfd, if any, are reaped first and in order
+        for (i = 0; i < active; i++) {
+            if (running[i].pidfd == -1) {
+                break;
+            }
         }
+        if (i < active) {
+            reap_command(commands, &running[i]);
+            running[i] = running[--active];
+            continue;
+        }
+
+        int nfds = epoll_wait(epoll_fd, events, sizeof(events) / sizeof(events[0]), -1);
+        if (nfds == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Error during epoll_wait");
+            // Fall back to plain waits, the commands still have to be reaped
+            for (i = 0; i < active; i++) {
+                close(running[i].pidfd);
+                running[i].pidfd = -1;
+            }
+            continue;
+        }
+
+        for (int j = 0; j < nfds; j++) {
+            for (i = 0; i < active; i++) {
+                if (running[i].pid == (pid_t)events[j].data.u64) {
+                    reap_command(commands, &running[i]);
+                    running[i] = running[--active];
+                    break;
+                }
+            }
+        }
+    }
+
+    for (i = 0; i < count; i++) {
+        int status = commands[i].status;
+        if (status == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            success = false;
+        }
+    }
+
+    if (epoll_fd != -1) {
+        close(epoll_fd);
     }
+    free(running);
+    return success;
 }
@@ -1,9 +1,31 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdarg.h>
+#include <stddef.h>
 
 bool do_system(const char *command);
 
 bool do_exec(int count, ...);
 
 bool do_exec_redirect(const char *outputfile, int count, ...);
+
+/**
+ * One command of a do_exec_batch() call
+ */
+struct exec_command {
+    /**
+     * Full path to the command followed by its arguments, NULL terminated
+     */
+    char *const *argv;
+    /**
+     * File receiving the standard output of the command, NULL to inherit it
+     */
+    const char *outputfile;
+    /**
+     * Set by do_exec_batch() to the waitpid() status of the command, or -1 if
+     * it could not be started
+     */
+    int status;
+};
+
+bool do_exec_batch(struct exec_command *commands, size_t count, size_t max_parallel);
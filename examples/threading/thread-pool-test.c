@@ -0,0 +1,314 @@
+#define _GNU_SOURCE
+#include "thread-pool.h"
+#include <sched.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+#define DEBUG_LOG(msg,...) printf("thread-pool-test: " msg "\n" , ##__VA_ARGS__)
+#define ERROR_LOG(msg,...) printf("thread-pool-test ERROR: " msg "\n" , ##__VA_ARGS__)
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            ERROR_LOG("%s:%d: %s", __FILE__, __LINE__, #cond); \
+            return false; \
+        } \
+    } while (0)
+
+static long now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+static void *square(void *arg)
+{
+    uintptr_t n = (uintptr_t)arg;
+
+    return (void *)(n * n);
+}
+
+static bool test_futures(void)
+{
+    struct thread_pool pool;
+    struct tp_future *futures[1000];
+    uintptr_t i;
+
+    CHECK(thread_pool_init(&pool, 4, 4) == 0);
+    for (i = 0; i < 1000; i++) {
+        futures[i] = thread_pool_submit_future(&pool, square, (void *)i);
+        CHECK(futures[i] != NULL);
+    }
+    for (i = 0; i < 1000; i++) {
+        CHECK((uintptr_t)tp_future_get(futures[i]) == i * i);
+        tp_future_release(futures[i]);
+    }
+    thread_pool_destroy(&pool);
+    return true;
+}
+
+static atomic_ulong callback_sum;
+
+static void add_result(void *result, void *arg)
+{
+    atomic_fetch_add(&callback_sum, (uintptr_t)result);
+}
+
+static bool test_callbacks(void)
+{
+    struct thread_pool pool;
+    unsigned long expected = 0;
+    uintptr_t i;
+
+    atomic_store(&callback_sum, 0);
+    CHECK(thread_pool_init(&pool, 2, 2) == 0);
+    for (i = 0; i < 10000; i++) {
+        CHECK(thread_pool_submit_callback(&pool, square, (void *)i, add_result, NULL) == 0);
+        expected += i * i;
+    }
+    // Queued tasks still run during destroy
+    thread_pool_destroy(&pool);
+    CHECK(atomic_load(&callback_sum) == expected);
+    return true;
+}
+
+struct fib_arg {
+    struct thread_pool *pool;
+    unsigned int n;
+};
+
+// Each call forks its first half on the pool and joins it, the shape work stealing is for
+static void *fib(void *arg)
+{
+    struct fib_arg *fa = arg;
+    struct fib_arg left = { fa->pool, fa->n - 1 }, right = { fa->pool, fa->n - 2 };
+    struct tp_future *future;
+    uintptr_t result;
+
+    if (fa->n < 2) {
+        return (void *)(uintptr_t)fa->n;
+    }
+    future = thread_pool_submit_future(fa->pool, fib, &left);
+    if (!future) {
+        return (void *)UINTPTR_MAX;
+    }
+    result = (uintptr_t)fib(&right);
+    result += (uintptr_t)tp_future_get(future);
+    tp_future_release(future);
+    return (void *)result;
+}
+
+static bool test_fork_join(void)
+{
+    struct thread_pool pool;
+    struct fib_arg arg = { &pool, 22 };
+    struct tp_future *future;
+
+    // Two workers waiting on thousands of nested futures only finish if waiting helps
+    CHECK(thread_pool_init(&pool, 2, 2) == 0);
+    future = thread_pool_submit_future(&pool, fib, &arg);
+    CHECK(future != NULL);
+    CHECK((uintptr_t)tp_future_get(future) == 17711);
+    tp_future_release(future);
+    thread_pool_destroy(&pool);
+    return true;
+}
+
+static atomic_long fired_at[3];
+
+static void *record_time(void *arg)
+{
+    atomic_store(&fired_at[(uintptr_t)arg], now_ms());
+    return NULL;
+}
+
+static bool test_timers(void)
+{
+    struct thread_pool pool;
+    struct tp_future *future;
+    long start;
+    int i;
+
+    // A single worker, so a sleeping timer would keep the plain task waiting
+    CHECK(thread_pool_init(&pool, 1, 1) == 0);
+    start = now_ms();
+    for (i = 0; i < 3; i++) {
+        atomic_store(&fired_at[i], 0);
+    }
+    CHECK(thread_pool_schedule(&pool, 300, record_time, (void *)2) == 0);
+    CHECK(thread_pool_schedule(&pool, 100, record_time, (void *)0) == 0);
+    CHECK(thread_pool_schedule(&pool, 200, record_time, (void *)1) == 0);
+
+    future = thread_pool_submit_future(&pool, square, (void *)3);
+    CHECK(future != NULL);
+    CHECK(tp_future_wait(future, 50));
+    tp_future_release(future);
+
+    usleep(400 * 1000);
+    for (i = 0; i < 3; i++) {
+        long delay = atomic_load(&fired_at[i]) - start;
+
+        CHECK(atomic_load(&fired_at[i]) != 0);
+        CHECK(delay >= 100 * (i + 1) && delay < 100 * (i + 1) + 80);
+    }
+
+    // Not due yet, dropped by destroy
+    atomic_store(&fired_at[0], 0);
+    CHECK(thread_pool_schedule(&pool, 10000, record_time, (void *)0) == 0);
+    thread_pool_destroy(&pool);
+    CHECK(atomic_load(&fired_at[0]) == 0);
+    return true;
+}
+
+static pthread_barrier_t barrier;
+
+static void *block_on_barrier(void *arg)
+{
+    pthread_barrier_wait(&barrier);
+    return NULL;
+}
+
+static bool test_growth(void)
+{
+    struct thread_pool pool;
+    struct tp_future *futures[8];
+    int i;
+
+    // Eight tasks waiting for each other need eight workers
+    pthread_barrier_init(&barrier, NULL, 8);
+    CHECK(thread_pool_init(&pool, 1, 8) == 0);
+    for (i = 0; i < 8; i++) {
+        futures[i] = thread_pool_submit_future(&pool, block_on_barrier, NULL);
+        CHECK(futures[i] != NULL);
+    }
+    for (i = 0; i < 8; i++) {
+        CHECK(tp_future_wait(futures[i], 2000));
+        tp_future_release(futures[i]);
+    }
+    CHECK(atomic_load(&pool.running) == 8);
+    thread_pool_destroy(&pool);
+    pthread_barrier_destroy(&barrier);
+    return true;
+}
+
+static atomic_bool released;
+
+static void *block_until_released(void *arg)
+{
+    while (!atomic_load(&released)) {
+        usleep(1000);
+    }
+    return NULL;
+}
+
+static bool test_blocking(void)
+{
+    struct thread_pool pool;
+    struct tp_future *futures[20], *future;
+    int i;
+
+    // Like connections, every blocked task holds its worker; a quick one submitted next still runs
+    atomic_store(&released, false);
+    CHECK(thread_pool_init(&pool, 2, 32) == 0);
+    for (i = 0; i < 20; i++) {
+        futures[i] = thread_pool_submit_future(&pool, block_until_released, NULL);
+        CHECK(futures[i] != NULL);
+    }
+    future = thread_pool_submit_future(&pool, square, (void *)7);
+    CHECK(future != NULL);
+    CHECK(tp_future_wait(future, 500));
+    tp_future_release(future);
+
+    atomic_store(&released, true);
+    for (i = 0; i < 20; i++) {
+        CHECK(tp_future_wait(futures[i], 2000));
+        tp_future_release(futures[i]);
+    }
+    thread_pool_destroy(&pool);
+    return true;
+}
+
+static void *current_cpu(void *arg)
+{
+    return (void *)(intptr_t)sched_getcpu();
+}
+
+static bool test_pinned(void)
+{
+    struct thread_pool pool;
+    struct tp_future *futures[16];
+    cpu_set_t allowed;
+    int cpu, i;
+
+    // The last CPU this process may run on
+    CHECK(sched_getaffinity(0, sizeof(allowed), &allowed) == 0);
+    for (cpu = CPU_SETSIZE - 1; cpu > 0 && !CPU_ISSET(cpu, &allowed); cpu--) {
+        ;
+    }
+
+    CHECK(thread_pool_init_pinned(&pool, 2, 4, cpu) == 0);
+    for (i = 0; i < 16; i++) {
+        futures[i] = thread_pool_submit_future(&pool, current_cpu, NULL);
+        CHECK(futures[i] != NULL);
+    }
+    for (i = 0; i < 16; i++) {
+        CHECK((intptr_t)tp_future_get(futures[i]) == cpu);
+        tp_future_release(futures[i]);
+    }
+    thread_pool_destroy(&pool);
+
+    CHECK(thread_pool_init_pinned(&pool, 1, 1, CPU_SETSIZE) == -1);
+    return true;
+}
+
+static bool test_timeout(void)
+{
+    struct thread_pool pool;
+    struct tp_future *future;
+
+    CHECK(thread_pool_init(&pool, 1, 1) == 0);
+    pthread_barrier_init(&barrier, NULL, 2);
+    future = thread_pool_submit_future(&pool, block_on_barrier, NULL);
+    CHECK(future != NULL);
+    CHECK(!tp_future_wait(future, 100));
+    pthread_barrier_wait(&barrier);
+    CHECK(tp_future_wait(future, 2000));
+    tp_future_release(future);
+    thread_pool_destroy(&pool);
+    pthread_barrier_destroy(&barrier);
+    return true;
+}
+
+int main(void)
+{
+    static const struct {
+        const char *name;
+        bool (*run)(void);
+    } tests[] = {
+        { "futures", test_futures },
+        { "callbacks", test_callbacks },
+        { "fork_join", test_fork_join },
+        { "timers", test_timers },
+        { "growth", test_growth },
+        { "blocking", test_blocking },
+        { "pinned", test_pinned },
+        { "timeout", test_timeout },
+    };
+    int failed = 0;
+
+    for (size_t i = 0; i < sizeof(tests) / sizeof(tests[0]); i++) {
+        bool ok = tests[i].run();
+
+        DEBUG_LOG("%s: %s", tests[i].name, ok ? "PASS" : "FAIL");
+        if (!ok) {
+            failed++;
+        }
+    }
+
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
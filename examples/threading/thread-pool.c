@@ -0,0 +1,725 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "thread-pool.h"
+
+#define NSEC_PER_MSEC 1000000ull
+#define NSEC_PER_SEC 1000000000ull
+
+// How often a worker waiting on a future looks for other tasks to run
+#define TP_HELP_POLL_NS NSEC_PER_MSEC
+
+struct tp_future {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool done;
+    void *result;
+    // One for the caller, one for the task
+    atomic_int refs;
+};
+
+struct tp_task {
+    tp_task_fn fn;
+    void *arg;
+    tp_done_fn done;
+    void *done_arg;
+    struct tp_future *future;
+    uint64_t deadline;              // Timed tasks only
+};
+
+// Worker running on this thread, NULL outside of any pool
+static __thread struct tp_worker *current_worker;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static int cond_timedwait_ns(pthread_cond_t *cond, pthread_mutex_t *lock, uint64_t deadline)
+{
+    struct timespec ts = {
+        .tv_sec = deadline / NSEC_PER_SEC,
+        .tv_nsec = deadline % NSEC_PER_SEC,
+    };
+
+    return pthread_cond_timedwait(cond, lock, &ts);
+}
+
+static int cond_init_monotonic(pthread_cond_t *cond)
+{
+    pthread_condattr_t attr;
+    int rc;
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    rc = pthread_cond_init(cond, &attr);
+    pthread_condattr_destroy(&attr);
+    return rc;
+}
+
+static int deque_init(struct tp_deque *deque)
+{
+    deque->tasks = malloc(TP_DEQUE_MIN_CAPACITY * sizeof(*deque->tasks));
+    if (!deque->tasks) {
+        return -1;
+    }
+    deque->capacity = TP_DEQUE_MIN_CAPACITY;
+    deque->top = 0;
+    deque->bottom = 0;
+    atomic_init(&deque->size, 0);
+    pthread_mutex_init(&deque->lock, NULL);
+    return 0;
+}
+
+static void deque_destroy(struct tp_deque *deque)
+{
+    pthread_mutex_destroy(&deque->lock);
+    free(deque->tasks);
+}
+
+static int deque_push(struct tp_deque *deque, struct tp_task *task)
+{
+    pthread_mutex_lock(&deque->lock);
+
+    if (deque->bottom - deque->top == deque->capacity) {
+        size_t capacity = deque->capacity * 2;
+        struct tp_task **tasks = malloc(capacity * sizeof(*tasks));
+
+        if (!tasks) {
+            pthread_mutex_unlock(&deque->lock);
+            return -1;
+        }
+        for (size_t i = deque->top; i != deque->bottom; i++) {
+            tasks[i & (capacity - 1)] = deque->tasks[i & (deque->capacity - 1)];
+        }
+        free(deque->tasks);
+        deque->tasks = tasks;
+        deque->capacity = capacity;
+    }
+
+    deque->tasks[deque->bottom++ & (deque->capacity - 1)] = task;
+    atomic_store_explicit(&deque->size, deque->bottom - deque->top, memory_order_relaxed);
+
+    pthread_mutex_unlock(&deque->lock);
+    return 0;
+}
+
+/*
+ * Take the newest task of @param deque when @param newest, the oldest otherwise.
+ * The owner of a deque takes back what it just queued while its data is still
+ * in cache; thieves and the shared queue go oldest first.
+ */
+static struct tp_task *deque_take(struct tp_deque *deque, bool newest)
+{
+    struct tp_task *task = NULL;
+
+    if (atomic_load_explicit(&deque->size, memory_order_relaxed) == 0) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&deque->lock);
+    if (deque->bottom != deque->top) {
+        if (newest) {
+            task = deque->tasks[--deque->bottom & (deque->capacity - 1)];
+        } else {
+            task = deque->tasks[deque->top++ & (deque->capacity - 1)];
+        }
+        atomic_store_explicit(&deque->size, deque->bottom - deque->top, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&deque->lock);
+
+    return task;
+}
+
+static void timer_sift_down(struct thread_pool *pool, size_t i)
+{
+    struct tp_task **heap = pool->timers;
+
+    for (;;) {
+        size_t child = 2 * i + 1, smallest = i;
+        struct tp_task *swap;
+
+        if (child < pool->timer_count && heap[child]->deadline < heap[smallest]->deadline) {
+            smallest = child;
+        }
+        if (child + 1 < pool->timer_count && heap[child + 1]->deadline < heap[smallest]->deadline) {
+            smallest = child + 1;
+        }
+        if (smallest == i) {
+            return;
+        }
+        swap = heap[i];
+        heap[i] = heap[smallest];
+        heap[smallest] = swap;
+        i = smallest;
+    }
+}
+
+static void timer_update_next(struct thread_pool *pool)
+{
+    atomic_store(&pool->next_deadline, pool->timer_count ? pool->timers[0]->deadline : UINT64_MAX);
+}
+
+// Called with the pool lock held
+static int timer_push(struct thread_pool *pool, struct tp_task *task)
+{
+    size_t i;
+
+    if (pool->timer_count == pool->timer_capacity) {
+        size_t capacity = pool->timer_capacity ? pool->timer_capacity * 2 : 16;
+        struct tp_task **timers = realloc(pool->timers, capacity * sizeof(*timers));
+
+        if (!timers) {
+            return -1;
+        }
+        pool->timers = timers;
+        pool->timer_capacity = capacity;
+    }
+
+    for (i = pool->timer_count++; i > 0; i = (i - 1) / 2) {
+        struct tp_task *parent = pool->timers[(i - 1) / 2];
+
+        if (parent->deadline <= task->deadline) {
+            break;
+        }
+        pool->timers[i] = parent;
+    }
+    pool->timers[i] = task;
+
+    timer_update_next(pool);
+    return 0;
+}
+
+/*
+ * Signal an idle worker nobody signalled yet. Called with the pool lock held.
+ * @return false if there is none
+ */
+static bool signal_idle_worker(struct thread_pool *pool)
+{
+    if (atomic_load(&pool->idle) <= pool->wakeups) {
+        return false;
+    }
+    pool->wakeups++;
+    pthread_cond_signal(&pool->work_cond);
+    return true;
+}
+
+/*
+ * Move the timed tasks due at @param now to the shared queue, waking an idle
+ * worker for each. Called with the pool lock held.
+ */
+static void release_due_timers(struct thread_pool *pool, uint64_t now)
+{
+    while (pool->timer_count > 0 && pool->timers[0]->deadline <= now) {
+        // Left in the heap when the queue can't grow, the next check retries
+        if (deque_push(&pool->injection, pool->timers[0]) == -1) {
+            break;
+        }
+        pool->timers[0] = pool->timers[--pool->timer_count];
+        timer_sift_down(pool, 0);
+
+        atomic_fetch_add(&pool->queued, 1);
+        signal_idle_worker(pool);
+    }
+    timer_update_next(pool);
+}
+
+static void *worker_main(void *arg);
+static void wake_worker(struct thread_pool *pool, bool grow);
+
+/*
+ * Start a worker in a free slot, joining the thread that retired from it if
+ * any. Called with the pool lock held.
+ */
+static int start_worker(struct thread_pool *pool)
+{
+    struct tp_worker *worker = NULL;
+    size_t i;
+
+    for (i = 0; i < pool->max_workers; i++) {
+        if (pool->workers[i].state != TP_WORKER_RUNNING) {
+            worker = &pool->workers[i];
+            break;
+        }
+    }
+    if (!worker) {
+        return -1;
+    }
+
+    // Already past its last use of the lock, the join doesn't wait on us
+    if (worker->state == TP_WORKER_RETIRED) {
+        pthread_join(worker->thread, NULL);
+        worker->state = TP_WORKER_EMPTY;
+    }
+
+    // Before it starts, the new worker must find its own slot in the range it steals from
+    if (i + 1 > atomic_load(&pool->slots_used)) {
+        atomic_store(&pool->slots_used, i + 1);
+    }
+    if (pool->cpu >= 0) {
+        pthread_attr_t attr;
+        cpu_set_t cpus;
+        int rc;
+
+        CPU_ZERO(&cpus);
+        CPU_SET(pool->cpu, &cpus);
+        pthread_attr_init(&attr);
+        rc = pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+        if (rc == 0) {
+            rc = pthread_create(&worker->thread, &attr, worker_main, worker);
+        }
+        pthread_attr_destroy(&attr);
+        if (rc != 0) {
+            errno = rc;
+            return -1;
+        }
+    } else if (pthread_create(&worker->thread, NULL, worker_main, worker) != 0) {
+        return -1;
+    }
+    worker->state = TP_WORKER_RUNNING;
+    atomic_fetch_add(&pool->running, 1);
+    return 0;
+}
+
+static struct tp_task *find_task(struct thread_pool *pool, struct tp_worker *self)
+{
+    uint64_t next = atomic_load_explicit(&pool->next_deadline, memory_order_relaxed);
+    struct tp_task *task;
+    size_t slots, start;
+
+    // Busy workers look at the timers too, idle ones may all be gone
+    if (next != UINT64_MAX && next <= now_ns()) {
+        pthread_mutex_lock(&pool->lock);
+        release_due_timers(pool, now_ns());
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    task = deque_take(&self->deque, true);
+    if (!task) {
+        task = deque_take(&pool->injection, false);
+        // Pass the rest of the outside work on, a wakeup may have been taken by a worker already up
+        if (task && atomic_load_explicit(&pool->injection.size, memory_order_relaxed) > 0) {
+            wake_worker(pool, true);
+        }
+    }
+    if (!task) {
+        // Start from a random victim so thieves spread over the busy workers
+        slots = atomic_load(&pool->slots_used);
+        self->seed ^= self->seed << 13;
+        self->seed ^= self->seed >> 17;
+        self->seed ^= self->seed << 5;
+        start = self->seed % slots;
+
+        for (size_t i = 0; i < slots && !task; i++) {
+            struct tp_worker *victim = &pool->workers[(start + i) % slots];
+
+            if (victim != self) {
+                task = deque_take(&victim->deque, false);
+            }
+        }
+    }
+
+    if (task) {
+        atomic_fetch_sub(&pool->queued, 1);
+    }
+    return task;
+}
+
+static void future_complete(struct tp_future *future, void *result)
+{
+    pthread_mutex_lock(&future->lock);
+    future->result = result;
+    future->done = true;
+    pthread_cond_broadcast(&future->cond);
+    pthread_mutex_unlock(&future->lock);
+
+    tp_future_release(future);
+}
+
+static void run_task(struct tp_task *task)
+{
+    void *result = task->fn(task->arg);
+
+    if (task->done) {
+        task->done(result, task->done_arg);
+    }
+    if (task->future) {
+        future_complete(task->future, result);
+    }
+    free(task);
+}
+
+/*
+ * Sleep until a task is queued, the first timer is due, or the worker has been
+ * idle long enough to retire.
+ * @return false when the worker has to exit
+ */
+static bool wait_for_work(struct thread_pool *pool, struct tp_worker *self)
+{
+    uint64_t idle_since = now_ns();
+    bool retire = false;
+
+    pthread_mutex_lock(&pool->lock);
+
+    for (;;) {
+        uint64_t now = now_ns(), wake = UINT64_MAX;
+
+        release_due_timers(pool, now);
+        if (atomic_load(&pool->queued) > 0) {
+            break;
+        }
+        // Queued tasks run before the pool stops
+        if (atomic_load(&pool->stopping)) {
+            retire = true;
+            break;
+        }
+        if (atomic_load(&pool->running) > pool->min_workers) {
+            wake = idle_since + THREAD_POOL_IDLE_MS * NSEC_PER_MSEC;
+            if (now >= wake) {
+                retire = true;
+                break;
+            }
+        }
+        if (pool->timer_count > 0 && pool->timers[0]->deadline < wake) {
+            wake = pool->timers[0]->deadline;
+        }
+
+        // Submitters count their task before looking for idle workers, so one of us sees the other
+        atomic_fetch_add(&pool->idle, 1);
+        if (atomic_load(&pool->queued) == 0) {
+            if (wake == UINT64_MAX) {
+                pthread_cond_wait(&pool->work_cond, &pool->lock);
+            } else {
+                cond_timedwait_ns(&pool->work_cond, &pool->lock, wake);
+            }
+        }
+        atomic_fetch_sub(&pool->idle, 1);
+        // Woken by a signal or not, this worker is no longer waiting for one
+        if (pool->wakeups > 0) {
+            pool->wakeups--;
+        }
+    }
+
+    if (retire) {
+        self->state = TP_WORKER_RETIRED;
+        atomic_fetch_sub(&pool->running, 1);
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+    return !retire;
+}
+
+static void *worker_main(void *arg)
+{
+    struct tp_worker *self = arg;
+    struct thread_pool *pool = self->pool;
+    struct tp_task *task;
+
+    current_worker = self;
+
+    for (;;) {
+        task = find_task(pool, self);
+        if (task) {
+            run_task(task);
+        } else if (!wait_for_work(pool, self)) {
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Wake an idle worker for a new task, or start one when none is idle and
+ * @param grow allows it
+ */
+static void wake_worker(struct thread_pool *pool, bool grow)
+{
+    if (atomic_load(&pool->idle) == 0 &&
+        (!grow || atomic_load(&pool->running) >= pool->max_workers)) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    if (!signal_idle_worker(pool) && grow && !atomic_load(&pool->stopping)) {
+        // On failure the task waits for one of the running workers
+        start_worker(pool);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static int submit_task(struct thread_pool *pool, tp_task_fn fn, void *arg,
+                       tp_done_fn done, void *done_arg, struct tp_future *future)
+{
+    struct tp_worker *self = current_worker;
+    bool local = self && self->pool == pool;
+    struct tp_task *task;
+    int rc;
+
+    // Tasks still running while the pool stops may queue more, others may not
+    if (!local && atomic_load(&pool->stopping)) {
+        errno = ESHUTDOWN;
+        return -1;
+    }
+
+    task = calloc(1, sizeof(*task));
+    if (!task) {
+        return -1;
+    }
+    task->fn = fn;
+    task->arg = arg;
+    task->done = done;
+    task->done_arg = done_arg;
+    task->future = future;
+
+    rc = deque_push(local ? &self->deque : &pool->injection, task);
+    if (rc == -1) {
+        free(task);
+        return -1;
+    }
+    atomic_fetch_add(&pool->queued, 1);
+
+    // A task queued by a worker waits for it or for a thief, only outside work grows the pool
+    wake_worker(pool, !local);
+    return 0;
+}
+
+int thread_pool_init(struct thread_pool *pool, size_t min_workers, size_t max_workers)
+{
+    return thread_pool_init_pinned(pool, min_workers, max_workers, -1);
+}
+
+int thread_pool_init_pinned(struct thread_pool *pool, size_t min_workers, size_t max_workers, int cpu)
+{
+    size_t i;
+
+    memset(pool, 0, sizeof(*pool));
+    if (cpu >= CPU_SETSIZE) {
+        errno = EINVAL;
+        return -1;
+    }
+    pool->cpu = cpu;
+    if (min_workers == 0) {
+        min_workers = 1;
+    }
+    if (max_workers < min_workers) {
+        max_workers = min_workers;
+    }
+    pool->min_workers = min_workers;
+    pool->max_workers = max_workers;
+
+    pool->workers = calloc(max_workers, sizeof(*pool->workers));
+    if (!pool->workers) {
+        return -1;
+    }
+    for (i = 0; i < max_workers; i++) {
+        pool->workers[i].pool = pool;
+        pool->workers[i].seed = i + 1;
+        if (deque_init(&pool->workers[i].deque) == -1) {
+            goto fail_deques;
+        }
+    }
+    if (deque_init(&pool->injection) == -1) {
+        goto fail_deques;
+    }
+    if (cond_init_monotonic(&pool->work_cond) != 0) {
+        deque_destroy(&pool->injection);
+        goto fail_deques;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    atomic_init(&pool->next_deadline, UINT64_MAX);
+
+    pthread_mutex_lock(&pool->lock);
+    for (i = 0; i < min_workers; i++) {
+        if (start_worker(pool) == -1) {
+            pthread_mutex_unlock(&pool->lock);
+            thread_pool_destroy(pool);
+            return -1;
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return 0;
+
+fail_deques:
+    while (i-- > 0) {
+        deque_destroy(&pool->workers[i].deque);
+    }
+    free(pool->workers);
+    return -1;
+}
+
+void thread_pool_destroy(struct thread_pool *pool)
+{
+    size_t i;
+
+    pthread_mutex_lock(&pool->lock);
+    atomic_store(&pool->stopping, true);
+    pthread_cond_broadcast(&pool->work_cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    // Only outside submissions start workers, and those are refused from now on
+    for (i = 0; i < pool->max_workers; i++) {
+        struct tp_worker *worker = &pool->workers[i];
+        bool started;
+
+        pthread_mutex_lock(&pool->lock);
+        started = worker->state != TP_WORKER_EMPTY;
+        pthread_mutex_unlock(&pool->lock);
+
+        if (started) {
+            pthread_join(worker->thread, NULL);
+        }
+        deque_destroy(&worker->deque);
+    }
+
+    for (i = 0; i < pool->timer_count; i++) {
+        free(pool->timers[i]);
+    }
+    free(pool->timers);
+    free(pool->workers);
+    deque_destroy(&pool->injection);
+    pthread_cond_destroy(&pool->work_cond);
+    pthread_mutex_destroy(&pool->lock);
+}
+
+int thread_pool_submit(struct thread_pool *pool, tp_task_fn fn, void *arg)
+{
+    return submit_task(pool, fn, arg, NULL, NULL, NULL);
+}
+
+int thread_pool_submit_callback(struct thread_pool *pool, tp_task_fn fn, void *arg, tp_done_fn done, void *done_arg)
+{
+    return submit_task(pool, fn, arg, done, done_arg, NULL);
+}
+
+struct tp_future *thread_pool_submit_future(struct thread_pool *pool, tp_task_fn fn, void *arg)
+{
+    struct tp_future *future = calloc(1, sizeof(*future));
+
+    if (!future) {
+        return NULL;
+    }
+    if (cond_init_monotonic(&future->cond) != 0) {
+        free(future);
+        return NULL;
+    }
+    pthread_mutex_init(&future->lock, NULL);
+    atomic_init(&future->refs, 2);
+
+    if (submit_task(pool, fn, arg, NULL, NULL, future) == -1) {
+        pthread_cond_destroy(&future->cond);
+        pthread_mutex_destroy(&future->lock);
+        free(future);
+        return NULL;
+    }
+    return future;
+}
+
+int thread_pool_schedule(struct thread_pool *pool, unsigned int delay_ms, tp_task_fn fn, void *arg)
+{
+    struct tp_worker *self = current_worker;
+    struct tp_task *task = calloc(1, sizeof(*task));
+
+    if (!task) {
+        return -1;
+    }
+    task->fn = fn;
+    task->arg = arg;
+    task->deadline = now_ns() + delay_ms * NSEC_PER_MSEC;
+
+    pthread_mutex_lock(&pool->lock);
+    if (atomic_load(&pool->stopping) || timer_push(pool, task) == -1) {
+        pthread_mutex_unlock(&pool->lock);
+        free(task);
+        return -1;
+    }
+
+    // A new first deadline shortens the sleep of an idle worker
+    if (pool->timers[0] == task && !signal_idle_worker(pool) &&
+        !(self && self->pool == pool) && atomic_load(&pool->running) < pool->max_workers) {
+        start_worker(pool);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return 0;
+}
+
+bool tp_future_wait(struct tp_future *future, int timeout_ms)
+{
+    struct tp_worker *self = current_worker;
+    uint64_t deadline = timeout_ms < 0 ? UINT64_MAX : now_ns() + timeout_ms * NSEC_PER_MSEC;
+    struct tp_task *task;
+    bool done;
+
+    for (;;) {
+        uint64_t now, wake;
+
+        pthread_mutex_lock(&future->lock);
+        done = future->done;
+        pthread_mutex_unlock(&future->lock);
+        if (done) {
+            return true;
+        }
+
+        /*
+         * A task waiting on tasks it queued itself would otherwise hold its
+         * worker, and with every worker waiting nothing would run them. The
+         * task run here may overrun the timeout.
+         */
+        if (self) {
+            task = find_task(self->pool, self);
+            if (task) {
+                run_task(task);
+                continue;
+            }
+        }
+
+        now = now_ns();
+        if (now >= deadline) {
+            return false;
+        }
+        wake = deadline;
+        if (self && wake - now > TP_HELP_POLL_NS) {
+            wake = now + TP_HELP_POLL_NS;
+        }
+
+        pthread_mutex_lock(&future->lock);
+        if (!future->done) {
+            if (wake == UINT64_MAX) {
+                pthread_cond_wait(&future->cond, &future->lock);
+            } else {
+                cond_timedwait_ns(&future->cond, &future->lock, wake);
+            }
+        }
+        pthread_mutex_unlock(&future->lock);
+    }
+}
+
+void *tp_future_get(struct tp_future *future)
+{
+    void *result;
+
+    tp_future_wait(future, -1);
+
+    pthread_mutex_lock(&future->lock);
+    result = future->result;
+    pthread_mutex_unlock(&future->lock);
+    return result;
+}
+
+void tp_future_release(struct tp_future *future)
+{
+    if (!future || atomic_fetch_sub(&future->refs, 1) != 1) {
+        return;
+    }
+    pthread_cond_destroy(&future->cond);
+    pthread_mutex_destroy(&future->lock);
+    free(future);
+}
@@ -0,0 +1,176 @@
+/*
+ * thread-pool.h
+ *
+ * A work stealing thread pool. Every worker owns a deque: tasks submitted by
+ * a task running on a worker go to the bottom of that worker's deque, which it
+ * takes back from newest to oldest, while idle workers steal the oldest tasks
+ * from the top of the others' deques. Tasks submitted from outside the pool go
+ * through a shared queue.
+ *
+ * The pool keeps min_workers threads and starts more, up to max_workers, when
+ * a task arrives from outside while none is idle, so tasks blocking for a long
+ * time, such as a client connection, don't hold up the rest. Workers above
+ * min_workers exit after THREAD_POOL_IDLE_MS without work.
+ *
+ * Timed tasks wait in a heap instead of on a sleeping thread. Idle workers
+ * sleep until the earliest deadline, and whichever checks first moves the due
+ * tasks to the shared queue. A due task still waits for a worker to be free
+ * when every worker is busy and the pool can't grow.
+ */
+
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#define THREAD_POOL_IDLE_MS 10000
+#define TP_DEQUE_MIN_CAPACITY 64
+
+/**
+ * A task returns a result, handed to its future or completion callback
+ */
+typedef void *(*tp_task_fn)(void *arg);
+
+/**
+ * Called on the worker right after the task, with its result
+ */
+typedef void (*tp_done_fn)(void *result, void *arg);
+
+struct tp_task;
+struct tp_future;
+
+struct tp_deque {
+    pthread_mutex_t lock;
+    struct tp_task **tasks;
+    size_t capacity;                // Power of two
+    size_t top;                     // Oldest task, where thieves take from
+    size_t bottom;                  // One past the newest task, where the owner pushes and pops
+    /**
+     * bottom - top, readable without the lock so thieves skip empty deques
+     */
+    atomic_size_t size;
+};
+
+enum tp_worker_state {
+    TP_WORKER_EMPTY,
+    TP_WORKER_RUNNING,
+    TP_WORKER_RETIRED,              // Exited, waiting to be joined
+};
+
+struct tp_worker {
+    struct thread_pool *pool;
+    struct tp_deque deque;
+    pthread_t thread;
+    enum tp_worker_state state;     // Protected by the pool lock
+    unsigned int seed;              // Picks the first victim to steal from
+};
+
+struct thread_pool {
+    size_t min_workers;
+    size_t max_workers;
+    /**
+     * CPU every worker is pinned to, -1 to let them run anywhere
+     */
+    int cpu;
+    /**
+     * max_workers slots, slots_used of them ever started
+     */
+    struct tp_worker *workers;
+    atomic_size_t slots_used;
+    struct tp_deque injection;
+    pthread_mutex_t lock;
+    /**
+     * Idle workers wait here, on CLOCK_MONOTONIC
+     */
+    pthread_cond_t work_cond;
+    /**
+     * Tasks sitting in a deque or the shared queue
+     */
+    atomic_size_t queued;
+    atomic_size_t idle;
+    /**
+     * Idle workers signalled but not awake yet, protected by lock; the others
+     * are free to take a new task
+     */
+    size_t wakeups;
+    atomic_size_t running;
+    /**
+     * Min heap of timed tasks by deadline, protected by lock
+     */
+    struct tp_task **timers;
+    size_t timer_count;
+    size_t timer_capacity;
+    /**
+     * Deadline of the first timer in CLOCK_MONOTONIC nanoseconds, UINT64_MAX
+     * without timers; lets busy workers check for due timers without the lock
+     */
+    _Atomic uint64_t next_deadline;
+    atomic_bool stopping;
+};
+
+/**
+ * Start @param min_workers threads, at least one, and allow up to @param max_workers.
+ * @return 0 on success, -1 on error.
+ */
+int thread_pool_init(struct thread_pool *pool, size_t min_workers, size_t max_workers);
+
+/**
+ * Like thread_pool_init(), with every worker pinned to @param cpu.
+ * @return 0 on success, -1 on error, such as a CPU that is offline or outside
+ *   the affinity mask of the process.
+ */
+int thread_pool_init_pinned(struct thread_pool *pool, size_t min_workers, size_t max_workers, int cpu);
+
+/**
+ * Run every task still queued, stop the workers and free the pool. Timed tasks
+ * that are not due yet are dropped.
+ */
+void thread_pool_destroy(struct thread_pool *pool);
+
+/**
+ * Queue @param fn to run with @param arg.
+ * @return 0 on success, -1 on error or once the pool is being destroyed.
+ */
+int thread_pool_submit(struct thread_pool *pool, tp_task_fn fn, void *arg);
+
+/**
+ * Queue @param fn and call @param done with its result once it ran.
+ * @return 0 on success, -1 on error.
+ */
+int thread_pool_submit_callback(struct thread_pool *pool, tp_task_fn fn, void *arg, tp_done_fn done, void *done_arg);
+
+/**
+ * Queue @param fn and return a future for its result, to be released with
+ * tp_future_release().
+ * @return the future, NULL on error.
+ */
+struct tp_future *thread_pool_submit_future(struct thread_pool *pool, tp_task_fn fn, void *arg);
+
+/**
+ * Queue @param fn to run once @param delay_ms have passed.
+ * @return 0 on success, -1 on error.
+ */
+int thread_pool_schedule(struct thread_pool *pool, unsigned int delay_ms, tp_task_fn fn, void *arg);
+
+/**
+ * Wait up to @param timeout_ms, -1 for no limit, for the task of @param future to
+ * finish. Called from a worker, runs other tasks of the pool while waiting.
+ * @return true if it finished.
+ */
+bool tp_future_wait(struct tp_future *future, int timeout_ms);
+
+/**
+ * @return the result of the task of @param future, waiting for it as needed.
+ */
+void *tp_future_get(struct tp_future *future);
+
+/**
+ * Drop @param future; the task still runs if it hasn't yet.
+ */
+void tp_future_release(struct tp_future *future);
+
+#endif /* THREAD_POOL_H */
@@ -8,6 +8,7 @@ set -u
 NUMFILES=10
 WRITESTR=AELD_IS_FUN
 WRITEDIR=/tmp/aeld-data
+NESTEDDIR=/tmp/aeld-data-nested
 #username=$(cat conf/username.txt)
 username=$(cat /etc/finder-app/conf/username.txt)
 
@@ -63,8 +64,35 @@ done
 OUTPUTSTRING=$(finder.sh "$WRITEDIR" "$WRITESTR")
 echo $OUTPUTSTRING > /tmp/assignment4-result.txt
 
+# finder walks the tree on several threads, it must count the same as finder.sh
+compare_finder()
+{
+	expected=$(finder.sh "$1" "$2")
+	actual=$(finder -j 4 "$1" "$2") || {
+		echo "failed: finder exited with an error on $1"
+		exit 1
+	}
+	if [ "$actual" != "$expected" ]
+	then
+		echo "failed: finder found '${actual}' in $1 but finder.sh found '${expected}'"
+		exit 1
+	fi
+}
+
+rm -rf "${NESTEDDIR}"
+for i in $( seq 1 $NUMFILES)
+do
+	dir="$NESTEDDIR/d$((i % 4))/e$((i % 3))/f$i"
+	mkdir -p "$dir"
+	writer "$dir/${username}$i.txt" "$WRITESTR"
+	writer "$dir/other$i.txt" "no match"
+done
+
+compare_finder "$WRITEDIR" "$WRITESTR"
+compare_finder "$NESTEDDIR" "$WRITESTR"
+
 # remove temporary directories
-rm -rf /tmp/aeld-data
+rm -rf /tmp/aeld-data "${NESTEDDIR}"
 
 set +e
 echo ${OUTPUTSTRING} | grep "${MATCHSTR}"
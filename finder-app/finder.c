@@ -0,0 +1,325 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "search.h"
+#include "thread-pool.h"
+
+// getdents64() buffer of a directory task
+#define DIRENT_BUFFER_SIZE (32 * 1024)
+/*
+ * Files up to this size are read into a buffer; mapping and unmapping costs
+ * more than copying them
+ */
+#define READ_MAX (64 * 1024)
+// Upper bound of -j, also caps the default on large machines
+#define MAX_JOBS 256
+
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+static struct {
+    const char *needle;
+    size_t needle_len;
+    struct thread_pool pool;
+    atomic_ulong files;
+    atomic_ulong matching_lines;
+    atomic_ulong errors;
+    /**
+     * Directories queued and not listed yet. Destroying the pool only waits for
+     * the tasks already queued, the walk is over once this drops to zero.
+     */
+    atomic_ulong pending;
+    pthread_mutex_t pending_lock;
+    pthread_cond_t pending_cond;
+} finder = {
+    .pending_lock = PTHREAD_MUTEX_INITIALIZER,
+    .pending_cond = PTHREAD_COND_INITIALIZER,
+};
+
+/*
+ * One directory to list. Every subdirectory becomes a task of its own, queued
+ * on the deque of the worker that found it, where idle workers steal it.
+ */
+struct dir_task {
+    // The directory given on the command line may be a symbolic link
+    bool root;
+    char path[];
+};
+
+// Per worker, tasks don't nest; kept off the stack, which is small with some C libraries
+static __thread char dirent_buffer[DIRENT_BUFFER_SIZE];
+static __thread char read_buffer[READ_MAX];
+
+static void *walk_dir(void *arg);
+
+static void report_error(const char *path, const char *name, int err)
+{
+    fprintf(stderr, "finder: %s%s%s: %s\n", path, name ? "/" : "", name ? name : "", strerror(err));
+    atomic_fetch_add(&finder.errors, 1);
+}
+
+/*
+ * @return the number of lines of @param data containing the needle, counting
+ * each line once however many times it matches
+ */
+static unsigned long count_matching_lines(const char *data, size_t length)
+{
+    const char *end = data + length;
+    unsigned long lines = 0;
+
+    while (data < end) {
+        const char *match = search_find(data, end - data, finder.needle, finder.needle_len);
+        const char *newline;
+
+        if (match == NULL) {
+            break;
+        }
+        lines++;
+
+        // The rest of the line can't add to the count
+        newline = memchr(match, '\n', end - match);
+        if (newline == NULL) {
+            break;
+        }
+        data = newline + 1;
+    }
+
+    return lines;
+}
+
+static void scan_file(int dir_fd, const char *path, const char *name)
+{
+    unsigned long lines = 0;
+    ssize_t length;
+    struct stat st;
+    int fd;
+
+    fd = openat(dir_fd, name, O_RDONLY | O_CLOEXEC | O_NOFOLLOW | O_NOCTTY);
+    if (fd == -1) {
+        report_error(path, name, errno);
+        return;
+    }
+
+    // Most files fit in one read, only a full buffer costs an fstat() and a mapping
+    do {
+        length = read(fd, read_buffer, sizeof(read_buffer));
+    } while (length == -1 && errno == EINTR);
+
+    if (length == -1) {
+        report_error(path, name, errno);
+    } else if (length < READ_MAX) {
+        lines = count_matching_lines(read_buffer, length);
+    } else if (fstat(fd, &st) == -1) {
+        report_error(path, name, errno);
+    } else {
+        void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+        if (data == MAP_FAILED) {
+            report_error(path, name, errno);
+        } else {
+            madvise(data, st.st_size, MADV_SEQUENTIAL);
+            lines = count_matching_lines(data, st.st_size);
+            munmap(data, st.st_size);
+        }
+    }
+    close(fd);
+
+    if (lines > 0) {
+        atomic_fetch_add(&finder.matching_lines, lines);
+    }
+}
+
+static void queue_dir(const char *path, const char *name)
+{
+    size_t path_len = strlen(path), name_len = name ? strlen(name) : 0;
+    struct dir_task *task = malloc(sizeof(*task) + path_len + name_len + 2);
+
+    if (task == NULL) {
+        report_error(path, name, errno);
+        return;
+    }
+    task->root = name == NULL;
+    memcpy(task->path, path, path_len);
+    if (name) {
+        task->path[path_len] = '/';
+        memcpy(task->path + path_len + 1, name, name_len + 1);
+    } else {
+        task->path[path_len] = '\0';
+    }
+
+    atomic_fetch_add(&finder.pending, 1);
+    if (thread_pool_submit(&finder.pool, walk_dir, task) == -1) {
+        report_error(path, name, errno);
+        atomic_fetch_sub(&finder.pending, 1);
+        free(task);
+    }
+}
+
+static void finish_dir(struct dir_task *task)
+{
+    free(task);
+
+    // Taking the lock keeps the wakeup from slipping in before main() waits
+    if (atomic_fetch_sub(&finder.pending, 1) == 1) {
+        pthread_mutex_lock(&finder.pending_lock);
+        pthread_cond_signal(&finder.pending_cond);
+        pthread_mutex_unlock(&finder.pending_lock);
+    }
+}
+
+static void *walk_dir(void *arg)
+{
+    struct dir_task *task = arg;
+    unsigned long files = 0;
+    long nread;
+    int fd;
+
+    fd = open(task->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC | (task->root ? 0 : O_NOFOLLOW));
+    if (fd == -1) {
+        report_error(task->path, NULL, errno);
+        finish_dir(task);
+        return NULL;
+    }
+
+    // One getdents64() returns hundreds of entries, with their types on most file systems
+    while ((nread = syscall(SYS_getdents64, fd, dirent_buffer, sizeof(dirent_buffer))) > 0) {
+        for (long offset = 0; offset < nread;) {
+            struct linux_dirent64 *entry = (struct linux_dirent64 *)(dirent_buffer + offset);
+            unsigned char type = entry->d_type;
+
+            offset += entry->d_reclen;
+
+            if (entry->d_name[0] == '.' &&
+                (entry->d_name[1] == '\0' || (entry->d_name[1] == '.' && entry->d_name[2] == '\0'))) {
+                continue;
+            }
+
+            if (type == DT_UNKNOWN) {
+                struct stat st;
+
+                if (fstatat(fd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+                    report_error(task->path, entry->d_name, errno);
+                    continue;
+                }
+                type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+            }
+
+            // Like find -type f and grep -r, symbolic links are not followed
+            if (type == DT_DIR) {
+                queue_dir(task->path, entry->d_name);
+            } else if (type == DT_REG) {
+                files++;
+                scan_file(fd, task->path, entry->d_name);
+            }
+        }
+    }
+    if (nread == -1) {
+        report_error(task->path, NULL, errno);
+    }
+
+    atomic_fetch_add(&finder.files, files);
+    close(fd);
+    finish_dir(task);
+    return NULL;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-j jobs] <filesdir> <searchstr>\n"
+            "  -j jobs   threads walking the tree, 1 to %d, default one per online CPU\n",
+            prog, MAX_JOBS);
+    exit(1);
+}
+
+static long parse_jobs(const char *prog, const char *arg)
+{
+    char *end;
+    long jobs;
+
+    errno = 0;
+    jobs = strtol(arg, &end, 10);
+    if (errno != 0 || end == arg || *end != '\0' || jobs < 1 || jobs > MAX_JOBS) {
+        fprintf(stderr, "Invalid number of jobs '%s'\n", arg);
+        usage(prog);
+    }
+    return jobs;
+}
+
+int main(int argc, char *argv[])
+{
+    long jobs = 0;
+    struct stat st;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "+j:")) != -1) {
+        switch (opt) {
+        case 'j':
+            jobs = parse_jobs(argv[0], optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (argc - optind != 2) {
+        fprintf(stderr, "Incorrect number of arguments, must be equal 2\n");
+        return 1;
+    }
+    if (argv[optind][0] == '\0' || argv[optind + 1][0] == '\0') {
+        fprintf(stderr, "Arguments cannot be null\n");
+        return 1;
+    }
+    if (stat(argv[optind], &st) == -1 || !S_ISDIR(st.st_mode)) {
+        fprintf(stderr, "First argument must be a directory\n");
+        return 1;
+    }
+
+    finder.needle = argv[optind + 1];
+    finder.needle_len = strlen(finder.needle);
+
+    if (jobs == 0) {
+        jobs = sysconf(_SC_NPROCESSORS_ONLN);
+        if (jobs < 1) {
+            jobs = 1;
+        } else if (jobs > MAX_JOBS) {
+            jobs = MAX_JOBS;
+        }
+    }
+    if (thread_pool_init(&finder.pool, jobs, jobs) == -1) {
+        fprintf(stderr, "Error starting %ld threads: %s\n", jobs, strerror(errno));
+        return 1;
+    }
+
+    queue_dir(argv[optind], NULL);
+
+    // Workers left idle while the walk still runs would retire during the destroy
+    pthread_mutex_lock(&finder.pending_lock);
+    while (atomic_load(&finder.pending) > 0) {
+        pthread_cond_wait(&finder.pending_cond, &finder.pending_lock);
+    }
+    pthread_mutex_unlock(&finder.pending_lock);
+    thread_pool_destroy(&finder.pool);
+
+    printf("The number of files are %lu and the number of matching lines are %lu\n",
+           atomic_load(&finder.files), atomic_load(&finder.matching_lines));
+
+    return atomic_load(&finder.errors) > 0 ? 1 : 0;
+}
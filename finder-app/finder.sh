@@ -28,11 +28,13 @@ fi
 filesdir=$1
 searchstr=$2
 
-total_files=$(find "$filesdir" -type f | wc -l)
-total_files_with_searchstr=$(grep -rl "$searchstr" "$filesdir" | wc -l)
+# One walk: grep -c prints a count for every file, matching or not
+counts=$(grep -rc -- "$searchstr" "$filesdir" | awk -F: '{ files++; lines += $NF } END { print files + 0, lines + 0 }')
+total_files=${counts% *}
+total_matching_lines=${counts#* }
 
 # DEBUG
 #echo "Directory: ${filesdir}"
 #echo "String   : ${searchstr}"
 
-echo "The number of files are ${total_files} and the number of matching lines are ${total_files_with_searchstr}"
+echo "The number of files are ${total_files} and the number of matching lines are ${total_matching_lines}"
@@ -0,0 +1,86 @@
+#!/bin/sh
+# Tester script for the batch mode of writer
+# Writes manifests with nested paths and checks the contents and exit status
+
+set -u
+
+WRITEDIR=/tmp/aeld-batch
+failures=0
+
+fail()
+{
+	echo "failed: $1"
+	failures=$((failures + 1))
+}
+
+# check_file <path> <expected content, printf format>
+check_file()
+{
+	if [ ! -f "$1" ]
+	then
+		fail "$1 was not written"
+	elif [ "$(cat "$1"; echo x)" != "$(printf "$2"; echo x)" ]
+	then
+		fail "$1 contains '$(cat "$1")'"
+	fi
+}
+
+rm -rf "${WRITEDIR}"
+mkdir -p "${WRITEDIR}"
+
+echo "Writing a line manifest with nested paths"
+{
+	for i in $(seq 1 300)
+	do
+		printf '%s/dir%d/sub%d/file%d.txt\tline %d\\tAELD_IS_FUN\\n\n' "${WRITEDIR}" $((i % 7)) $((i % 3)) $i $i
+	done
+	printf '%s/a/b/c/d/e/deep.txt\tback\\\\slash\n' "${WRITEDIR}"
+} > "${WRITEDIR}/manifest"
+
+writer -b -j 4 "${WRITEDIR}/manifest"
+rc=$?
+if [ $rc -ne 0 ]
+then
+	fail "line manifest exited with status $rc"
+fi
+for i in 1 150 300
+do
+	check_file "${WRITEDIR}/dir$((i % 7))/sub$((i % 3))/file$i.txt" "line $i\tAELD_IS_FUN\n"
+done
+check_file "${WRITEDIR}/a/b/c/d/e/deep.txt" 'back\\slash'
+count=$(find "${WRITEDIR}" -name '*.txt' | wc -l)
+if [ "$count" -ne 301 ]
+then
+	fail "expected 301 files but found $count"
+fi
+
+echo "Writing a NUL separated manifest from stdin"
+printf '%s/nul/one.txt\0first\nline\0%s/nul/two/two.txt\0\0' "${WRITEDIR}" "${WRITEDIR}" | writer -b -0 -s
+rc=$?
+if [ $rc -ne 0 ]
+then
+	fail "NUL separated manifest exited with status $rc"
+fi
+check_file "${WRITEDIR}/nul/one.txt" 'first\nline'
+check_file "${WRITEDIR}/nul/two/two.txt" ''
+
+echo "Writing a manifest with an unwritable path"
+printf '%s/ok.txt\tstill written\n%s/manifest/not-a-dir.txt\tnever written\n' "${WRITEDIR}" "${WRITEDIR}" |
+	writer -b 2>/dev/null
+rc=$?
+if [ $rc -ne 1 ]
+then
+	fail "unwritable path exited with status $rc instead of 1"
+fi
+check_file "${WRITEDIR}/ok.txt" 'still written'
+
+rm -rf "${WRITEDIR}"
+
+if [ $failures -eq 0 ]
+then
+	echo "success"
+	exit 0
+else
+	echo "${failures} checks failed"
+	exit 1
+fi
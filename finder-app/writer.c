@@ -1,14 +1,433 @@
+#define _GNU_SOURCE
 #include <syslog.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
-#include <libgen.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <sys/stat.h>
+
+#include "thread-pool.h"
+
+// Files written by one task of batch mode
+#define BATCH_SIZE 256
+// Upper bound of -j, also caps the default on large machines
+#define MAX_JOBS 256
+
+/*
+ * One (path, content) pair of the manifest. In line mode content points into
+ * the buffer of path, with -0 each has its own.
+ */
+struct write_entry {
+    char *path;
+    char *content;
+    size_t length;
+    bool own_content;
+};
+
+struct write_batch {
+    struct write_entry entries[BATCH_SIZE];
+    size_t count;
+};
+
+static struct {
+    bool sync;
+    // Batches queued or being written are bounded, so a long stream doesn't pile up in memory
+    sem_t slots;
+    atomic_ulong written;
+    atomic_ulong failed;
+} batch_mode;
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s <writefile> <writestr>\n"
+            "       %s -b [-0] [-j jobs] [-s] [manifest]\n"
+            "  -b        write every (path, content) pair of manifest, or of stdin when\n"
+            "            it is missing or -, creating directories as needed; must come\n"
+            "            first, the other options only exist in batch mode\n"
+            "  -0        pairs are NUL terminated path and content, instead of one\n"
+            "            path<TAB>content line per file with \\n, \\t and \\\\ escapes\n"
+            "  -j jobs   threads writing files, 1 to %d, default one per online CPU\n"
+            "  -s        sync the file system once per batch of %d files\n",
+            prog, prog, MAX_JOBS, BATCH_SIZE);
+    exit(1);
+}
+
+static long parse_jobs(const char *prog, const char *arg)
+{
+    char *end;
+    long jobs;
+
+    errno = 0;
+    jobs = strtol(arg, &end, 10);
+    if (errno != 0 || end == arg || *end != '\0' || jobs < 1 || jobs > MAX_JOBS) {
+        fprintf(stderr, "Invalid number of jobs '%s'\n", arg);
+        usage(prog);
+    }
+    return jobs;
+}
+
+/*
+ * Create @param dir and its missing parents, trying the deepest one first since
+ * it usually is the only one missing. @param dir is modified during the call.
+ */
+static int make_dirs(char *dir)
+{
+    char *slash;
+    int rc;
+
+    if (mkdir(dir, 0755) == 0 || errno == EEXIST) {
+        return 0;
+    }
+    if (errno != ENOENT) {
+        return -1;
+    }
+
+    slash = strrchr(dir, '/');
+    if (slash == NULL || slash == dir) {
+        return -1;
+    }
+    *slash = '\0';
+    rc = make_dirs(dir);
+    *slash = '/';
+    if (rc == -1) {
+        return -1;
+    }
+
+    return mkdir(dir, 0755) == 0 || errno == EEXIST ? 0 : -1;
+}
+
+static int open_creating_dirs(const char *path)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    char *dir, *slash;
+
+    // Directories only cost a syscall for the files that need them
+    if (fd != -1 || errno != ENOENT) {
+        return fd;
+    }
+
+    dir = strdup(path);
+    if (dir == NULL) {
+        return -1;
+    }
+    slash = strrchr(dir, '/');
+    if (slash != NULL && slash != dir) {
+        *slash = '\0';
+        if (make_dirs(dir) == 0) {
+            fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        }
+    } else {
+        errno = ENOENT;
+    }
+    free(dir);
+
+    return fd;
+}
+
+static int write_all(int fd, const char *data, size_t length)
+{
+    while (length > 0) {
+        ssize_t written = write(fd, data, length);
+
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += written;
+        length -= written;
+    }
+
+    return 0;
+}
+
+static void *write_batch(void *arg)
+{
+    struct write_batch *batch = arg;
+    int sync_fd = -1;
+
+    for (size_t i = 0; i < batch->count; i++) {
+        struct write_entry *entry = &batch->entries[i];
+        int fd = open_creating_dirs(entry->path);
+
+        if (fd == -1) {
+            syslog(LOG_ERR, "Error creating file '%s': %s", entry->path, strerror(errno));
+            atomic_fetch_add(&batch_mode.failed, 1);
+            continue;
+        }
+        if (write_all(fd, entry->content, entry->length) == -1) {
+            syslog(LOG_ERR, "Error writting to file '%s': %s", entry->path, strerror(errno));
+            atomic_fetch_add(&batch_mode.failed, 1);
+        } else {
+            atomic_fetch_add(&batch_mode.written, 1);
+        }
+
+        // Kept open to name the file system for syncfs()
+        if (batch_mode.sync && sync_fd == -1) {
+            sync_fd = fd;
+        } else {
+            close(fd);
+        }
+    }
+
+    // One flush for the whole batch instead of an fsync() per file
+    if (sync_fd != -1) {
+        if (syncfs(sync_fd) == -1) {
+            syslog(LOG_ERR, "Error syncing batch: %s", strerror(errno));
+            atomic_fetch_add(&batch_mode.failed, 1);
+        }
+        close(sync_fd);
+    }
+
+    return NULL;
+}
+
+static void free_batch(void *result, void *arg)
+{
+    struct write_batch *batch = arg;
+
+    for (size_t i = 0; i < batch->count; i++) {
+        free(batch->entries[i].path);
+        if (batch->entries[i].own_content) {
+            free(batch->entries[i].content);
+        }
+    }
+    free(batch);
+    sem_post(&batch_mode.slots);
+}
+
+/*
+ * Decode the escapes of a manifest line in place.
+ * @return the decoded length
+ */
+static size_t unescape(char *str, size_t length)
+{
+    size_t in, out = 0;
+
+    for (in = 0; in < length; in++) {
+        if (str[in] == '\\' && in + 1 < length) {
+            switch (str[in + 1]) {
+            case 'n':
+                str[out++] = '\n';
+                in++;
+                continue;
+            case 't':
+                str[out++] = '\t';
+                in++;
+                continue;
+            case '\\':
+                str[out++] = '\\';
+                in++;
+                continue;
+            }
+        }
+        str[out++] = str[in];
+    }
+
+    return out;
+}
+
+/*
+ * Read the next pair of @param manifest into @param entry.
+ * @return 1 when read, 0 at the end of the manifest, -1 for a malformed pair
+ */
+static int read_entry(FILE *manifest, bool nul_separated, struct write_entry *entry)
+{
+    char *line = NULL, *content = NULL, *tab;
+    size_t cap = 0;
+    ssize_t len;
+
+    if (nul_separated) {
+        len = getdelim(&line, &cap, '\0', manifest);
+        if (len == -1) {
+            free(line);
+            return 0;
+        }
+        cap = 0;
+        len = getdelim(&content, &cap, '\0', manifest);
+        if (len == -1) {
+            free(line);
+            free(content);
+            return -1;
+        }
+        // getdelim() keeps the delimiter, unless the stream ended first
+        if (len > 0 && content[len - 1] == '\0') {
+            len--;
+        }
+        entry->path = line;
+        entry->content = content;
+        entry->length = len;
+        entry->own_content = true;
+        return 1;
+    }
+
+    do {
+        len = getline(&line, &cap, manifest);
+        if (len == -1) {
+            free(line);
+            return 0;
+        }
+        if (len > 0 && line[len - 1] == '\n') {
+            line[--len] = '\0';
+        }
+    } while (len == 0);
+
+    tab = memchr(line, '\t', len);
+    if (tab == NULL) {
+        free(line);
+        return -1;
+    }
+    *tab = '\0';
+    entry->path = line;
+    entry->content = tab + 1;
+    entry->length = unescape(tab + 1, len - (tab + 1 - line));
+    entry->own_content = false;
+    return 1;
+}
+
+static int run_batch(const char *manifest_path, bool nul_separated, long jobs)
+{
+    struct thread_pool pool;
+    struct write_batch *batch = NULL;
+    FILE *manifest = stdin;
+    unsigned long pairs = 0;
+    int rc;
+
+    if (manifest_path != NULL && strcmp(manifest_path, "-") != 0) {
+        manifest = fopen(manifest_path, "r");
+        if (manifest == NULL) {
+            syslog(LOG_ERR, "Error opening manifest '%s': %s", manifest_path, strerror(errno));
+            fprintf(stderr, "Error opening manifest '%s': %s\n", manifest_path, strerror(errno));
+            return 1;
+        }
+    }
+
+    if (thread_pool_init(&pool, jobs, jobs) == -1) {
+        syslog(LOG_ERR, "Error starting %ld writer threads", jobs);
+        if (manifest != stdin) {
+            fclose(manifest);
+        }
+        return 1;
+    }
+    sem_init(&batch_mode.slots, 0, 2 * jobs);
+
+    for (;;) {
+        struct write_entry entry;
+
+        rc = read_entry(manifest, nul_separated, &entry);
+        if (rc == -1) {
+            syslog(LOG_ERR, "Malformed manifest entry %lu", pairs + 1);
+            atomic_fetch_add(&batch_mode.failed, 1);
+            pairs++;
+            continue;
+        }
+        if (rc == 1) {
+            if (batch == NULL) {
+                batch = malloc(sizeof(*batch));
+                if (batch == NULL) {
+                    syslog(LOG_ERR, "Error allocating memory.");
+                    free(entry.path);
+                    if (entry.own_content) {
+                        free(entry.content);
+                    }
+                    break;
+                }
+                batch->count = 0;
+            }
+            batch->entries[batch->count++] = entry;
+            pairs++;
+        }
+
+        if (batch != NULL && (batch->count == BATCH_SIZE || rc == 0)) {
+            while (sem_wait(&batch_mode.slots) == -1 && errno == EINTR) {
+                ;
+            }
+            if (thread_pool_submit_callback(&pool, write_batch, batch, free_batch, batch) == -1) {
+                syslog(LOG_ERR, "Error queueing batch: %s", strerror(errno));
+                atomic_fetch_add(&batch_mode.failed, batch->count);
+                free_batch(NULL, batch);
+            }
+            batch = NULL;
+        }
+        if (rc == 0) {
+            break;
+        }
+    }
+
+    if (ferror(manifest)) {
+        syslog(LOG_ERR, "Error reading manifest: %s", strerror(errno));
+        atomic_fetch_add(&batch_mode.failed, 1);
+    }
+    if (manifest != stdin) {
+        fclose(manifest);
+    }
+
+    // Runs the batches still queued
+    thread_pool_destroy(&pool);
+    sem_destroy(&batch_mode.slots);
+
+    syslog(LOG_DEBUG, "Wrote %lu of %lu files", atomic_load(&batch_mode.written), pairs);
+    if (atomic_load(&batch_mode.failed) > 0) {
+        fprintf(stderr, "%lu errors writing %lu files, see syslog\n", atomic_load(&batch_mode.failed), pairs);
+        return 1;
+    }
+    return 0;
+}
 
 int main(int argc, char *argv[])
 {
     openlog("writer", LOG_PID, LOG_USER);
 
+    /*
+     * Options only exist in batch mode, selected by -b as the first argument, so
+     * any other writefile or writestr starting with '-' is written as before
+     */
+    if (argc >= 2 && strcmp(argv[1], "-b") == 0) {
+        bool nul_separated = false;
+        long jobs = 0;
+        int opt, rc;
+
+        // '+' stops at the manifest
+        optind = 2;
+        while ((opt = getopt(argc, argv, "+0j:s")) != -1) {
+            switch (opt) {
+            case '0':
+                nul_separated = true;
+                break;
+            case 'j':
+                jobs = parse_jobs(argv[0], optarg);
+                break;
+            case 's':
+                batch_mode.sync = true;
+                break;
+            default:
+                usage(argv[0]);
+            }
+        }
+
+        if (argc - optind > 1) {
+            usage(argv[0]);
+        }
+        if (jobs == 0) {
+            jobs = sysconf(_SC_NPROCESSORS_ONLN);
+            if (jobs < 1) {
+                jobs = 1;
+            } else if (jobs > MAX_JOBS) {
+                jobs = MAX_JOBS;
+            }
+        }
+        rc = run_batch(optind < argc ? argv[optind] : NULL, nul_separated, jobs);
+        closelog();
+        return rc;
+    }
+
     if (argc != 3) {
         fprintf(stderr, "Incorrect number of arguments, must be equal 2.\n");
         syslog(LOG_ERR, "Incorrect number of arguments, must be equal 2.");
@@ -19,18 +438,9 @@ int main(int argc, char *argv[])
     char *writefile = argv[1];
     char *writestr = argv[2];
 
-    char *dirpath = strdup(writefile);
-    if (dirpath == NULL) {
-        syslog(LOG_ERR, "Error allocating memory.");
-        closelog();
-        return 1;
-    }
-    dirpath = dirname(dirpath);
-
     FILE *file = fopen(writefile, "w");
     if (file == NULL) {
         syslog(LOG_ERR, "Error creating file '%s': %s", writefile, strerror(errno));
-        free(dirpath);
         closelog();
         return 1;
     }
@@ -38,7 +448,6 @@ int main(int argc, char *argv[])
     if (fprintf(file, "%s", writestr) < 0) {
         syslog(LOG_ERR, "Error writting to file '%s': %s", writefile, strerror(errno));
         fclose(file);
-        free(dirpath);
         closelog();
         return 1;
     } else {
@@ -46,7 +455,6 @@ int main(int argc, char *argv[])
     }
 
     fclose(file);
-    free(dirpath);
     closelog();
 
     return 0;
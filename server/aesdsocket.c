@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -5,6 +6,7 @@
 #include <errno.h>
 #include <signal.h>
 #include <pthread.h>
+#include <sched.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -13,29 +15,138 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <stdbool.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <poll.h>
+
+#include "async-log.h"
+#include "channel.h"
+#include "listener.h"
+#include "replication.h"
+#include "store.h"
+#include "thread-pool.h"
+#include "timer-wheel.h"
 
-#define PORT 9000
-#define BACKLOG 10
 #define BUFFER_SIZE 1024
+#define MAX_EVENTS 16
+
+/*
+ * Sent alone on a line over the local socket, asks for a read only descriptor
+ * of DATA_FILE instead of a copy of its content
+ */
+#define GETFD_COMMAND "AESD_GETFD\n"
+
+/*
+ * Followed by a pattern up to the end of the line, asks for the packets of the
+ * history containing the pattern instead of storing the line
+ */
+#define SEARCH_COMMAND "AESD_SEARCH "
+
+/*
+ * Followed by a channel name up to the end of the line, moves the connection
+ * to that channel: later packets, readbacks and commands use its history
+ */
+#define CHANNEL_COMMAND "AESD_CHANNEL "
+
+enum command {
+    COMMAND_NONE,
+    COMMAND_GETFD,
+    COMMAND_SEARCH,
+    COMMAND_CHANNEL,
+};
+
+#define TIMER_TICK_MS 100
+#define TIMESTAMP_INTERVAL_MS 10000
+#define IDLE_TIMEOUT_MS 300000
+#define METRICS_INTERVAL_MS 60000
+#define SHUTDOWN_DRAIN_MS 2000
+
+/*
+ * A connection holds its worker until it closes, so the pool grows with the
+ * number of open connections; later ones wait for a worker past the maximum
+ */
+#define CONNECTION_WORKERS_MIN 4
+#define CONNECTION_WORKERS_MAX 1024
+
+/*
+ * Low latency mode (-C): connections run on workers pinned to the CPU their
+ * packets arrive on, and poll their socket for up to a spin budget before
+ * sleeping. The budget of each connection adapts between SPIN_MIN_NS and
+ * SPIN_MAX_NS to how long its client usually takes, or drops to 0 for
+ * clients that pause longer than that.
+ */
+#define SPIN_MIN_NS 2000
+#define SPIN_START_NS 20000
+#define SPIN_MAX_NS 200000
+
+#ifndef SO_INCOMING_CPU
+#define SO_INCOMING_CPU 49
+#endif
 
-//#ifndef USE_AESD_CHAR_DEVICE
+#ifndef USE_AESD_CHAR_DEVICE
 #define USE_AESD_CHAR_DEVICE 1
-//#endif
+#endif
 
+// Channel NAME is kept in DATA_FILE CHANNEL_SEPARATOR NAME
 #if USE_AESD_CHAR_DEVICE
 #define DATA_FILE "/dev/aesdchar"
+#define CHANNEL_SEPARATOR ""
 #else
 #define DATA_FILE "/var/tmp/aesdsocketdata"
+#define CHANNEL_SEPARATOR "."
 #endif
 
-pthread_mutex_t file_mutex = PTHREAD_MUTEX_INITIALIZER;
-volatile sig_atomic_t terminate = 0;
+static struct channel_table channels;
+static struct listener listeners[LISTENER_MAX];
+static int listener_count = 0;
+// Accepts the stream of a primary when running as a follower
+static struct listener replication_listener = { .fd = -1 };
+static struct replica replica;
+static struct replication replication;
+// Followers only take packets from their primary
+static bool read_only = false;
+// Becomes readable once shutdown starts, telling connection threads to drain
+static int stop_fd = -1;
+// Write end of the pipe daemonize() waits on, -1 when not daemonized
+static int startup_fd = -1;
+static struct timer_wheel timer_wheel;
+static struct thread_pool connection_pool;
+
+struct cpu_pool {
+    int cpu;
+    struct thread_pool pool;
+};
+
+// One pool per CPU given with -C, none otherwise
+static struct cpu_pool *cpu_pools;
+static int cpu_pool_count = 0;
+// Spreads the connections arriving on other CPUs, main thread only
+static unsigned int cpu_pool_next = 0;
+// Set with stop_fd, seen by spinning connections that don't poll it
+static atomic_bool stopping = false;
+
+static struct {
+    atomic_ulong connections;
+    atomic_ulong idle_timeouts;
+} metrics;
 
 struct thread_data {
     int client_fd;
-    struct sockaddr_in client_addr;
-    pthread_t thread_id;
+    struct sockaddr_storage client_addr;
+    char peer[LISTENER_PEER_LEN];
+    // History of the channel the client selected, the default one until then
+    struct data_store *store;
+    // Completes once the handler returned
+    struct tp_future *future;
+    struct tw_timer idle_timer;
+    // Low latency mode only
+    unsigned int spin_ns;
+    bool warned_read_only;
     bool completed;
+    bool joined;
 };
 
 struct thread_node {
@@ -46,60 +157,303 @@ struct thread_node {
 static struct thread_node *thread_list_head = NULL;
 static pthread_mutex_t thread_list_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-void handle_signal(int signo) {
-    syslog(LOG_INFO, "Caught signal, exiting");
-    terminate = 1;
+// Hand the client its own descriptor of the channel history through SCM_RIGHTS
+static int send_data_fd(struct thread_data *thread_data) {
+    char byte = 0;
+    struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf),
+    };
+    struct cmsghdr *cmsg;
+    int file_fd, rc = 0;
+
+    file_fd = store_open_readonly(thread_data->store);
+    if (file_fd == -1)
+        return -1;
+
+    memset(&control, 0, sizeof(control));
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &file_fd, sizeof(int));
+
+    if (sendmsg(thread_data->client_fd, &msg, MSG_NOSIGNAL) == -1) {
+        AESD_LOG(LOG_ERR, LOG_TYPE_CLIENT_IO, "Error passing file descriptor to client: %s", strerror(errno));
+        rc = -1;
+    }
+
+    close(file_fd);
+    return rc;
 }
 
-void *connection_handler(void *arg) {
-    struct thread_data *thread_data = (struct thread_data *)arg;
-    char buffer[BUFFER_SIZE];
-    ssize_t bytes_received;
-    int file_fd = -1;
+static enum command parse_command(const struct thread_data *thread_data, const char *line, size_t len) {
+    if (thread_data->client_addr.ss_family == AF_UNIX &&
+        len == strlen(GETFD_COMMAND) && memcmp(line, GETFD_COMMAND, len) == 0)
+        return COMMAND_GETFD;
+    if (len > strlen(SEARCH_COMMAND) && memcmp(line, SEARCH_COMMAND, strlen(SEARCH_COMMAND)) == 0)
+        return COMMAND_SEARCH;
+    if (len > strlen(CHANNEL_COMMAND) && memcmp(line, CHANNEL_COMMAND, strlen(CHANNEL_COMMAND)) == 0)
+        return COMMAND_CHANNEL;
+    return COMMAND_NONE;
+}
 
-    syslog(LOG_INFO, "Accepted connection from %s", inet_ntoa(thread_data->client_addr.sin_addr));
+static int run_command(struct thread_data *thread_data, enum command command, const char *line, size_t len) {
+    struct data_store *store;
+
+    // Arguments run up to, not including, the newline
+    switch (command) {
+    case COMMAND_GETFD:
+        return send_data_fd(thread_data);
+    case COMMAND_SEARCH:
+        return store_send_matches(thread_data->store, thread_data->client_fd, line + strlen(SEARCH_COMMAND),
+                                  len - strlen(SEARCH_COMMAND) - 1);
+    case COMMAND_CHANNEL:
+        store = channel_select(&channels, line + strlen(CHANNEL_COMMAND), len - strlen(CHANNEL_COMMAND) - 1);
+        if (!store)
+            return -1;
+        thread_data->store = store;
+        return 0;
+    default:
+        return 0;
+    }
+}
 
-    while ((bytes_received = recv(thread_data->client_fd, buffer, BUFFER_SIZE - 1, 0)) > 0) {
-        buffer[bytes_received] = '\0';  // Null-terminate for string handling
+static int commit_packets(struct thread_data *thread_data, const char *data, size_t len) {
+    if (!read_only)
+        return store_commit(thread_data->store, data, len);
 
-        pthread_mutex_lock(&file_mutex);
+    // Still answered with the history, the point of a follower is serving readbacks
+    if (!thread_data->warned_read_only)
+        AESD_LOG(LOG_WARNING, LOG_TYPE_DATA, "Read only follower, dropping packets from %s", thread_data->peer);
+    thread_data->warned_read_only = true;
+    return 0;
+}
 
-        if (file_fd == -1) {
-            /* file_fd = open(DATA_FILE, O_RDWR | O_CREAT | O_APPEND, 0666); */
-            file_fd = open(DATA_FILE, O_RDWR | O_CREAT, 0666);
-            if (file_fd == -1) {
-                syslog(LOG_ERR, "Error opening file %s: %s", DATA_FILE, strerror(errno));
-                pthread_mutex_unlock(&file_mutex);
-                break;
+/*
+ * Commit every complete packet in @data, handling command lines in between.
+ * Runs of ordinary packets go through a single store_commit() call.
+ */
+static int process_packets(struct thread_data *thread_data, const char *data, size_t len) {
+    const char *end = data + len;
+    const char *run = data, *line = data;
+    bool committed = false;
+
+    while (line < end) {
+        const char *next = (const char *)memchr(line, '\n', end - line) + 1;
+        enum command command = parse_command(thread_data, line, next - line);
+
+        if (command != COMMAND_NONE) {
+            if (line > run) {
+                if (commit_packets(thread_data, run, line - run) == -1)
+                    return -1;
+                committed = true;
             }
+            if (run_command(thread_data, command, line, next - line) == -1)
+                return -1;
+            run = next;
+        }
+        line = next;
+    }
+
+    if (end > run) {
+        if (commit_packets(thread_data, run, end - run) == -1)
+            return -1;
+        committed = true;
+    }
+
+    return committed ? store_send_history(thread_data->store, thread_data->client_fd) : 0;
+}
+
+static void idle_timeout(struct tw_timer *timer, void *arg) {
+    struct thread_data *thread_data = arg;
+
+    // Wakes the recv() in connection_handler, which then tears the connection down
+    shutdown(thread_data->client_fd, SHUT_RDWR);
+    atomic_fetch_add(&metrics.idle_timeouts, 1);
+}
+
+#if !USE_AESD_CHAR_DEVICE
+static void append_timestamp(struct tw_timer *timer, void *arg) {
+    char timestamp[128];
+    time_t now = time(NULL);
+    struct tm tm;
+    size_t len;
+
+    localtime_r(&now, &tm);
+    len = strftime(timestamp, sizeof(timestamp), "timestamp:%a, %d %b %Y %T %z\n", &tm);
+    if (len > 0)
+        store_commit(channel_default(&channels), timestamp, len);
+}
+#endif
+
+static void flush_metrics(struct tw_timer *timer, void *arg) {
+    unsigned long packets, bytes;
+
+    channel_table_stats(&channels, &packets, &bytes);
+    AESD_LOG(LOG_INFO, LOG_TYPE_SERVER,
+             "Metrics: %lu connections, %lu packets, %lu bytes committed, %lu idle timeouts",
+             atomic_load(&metrics.connections), packets, bytes, atomic_load(&metrics.idle_timeouts));
+}
+
+static uint64_t monotonic_ns() {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+/*
+ * Wait for the client by polling its socket, for up to the spin budget of the
+ * connection. Each non blocking recv() also busy polls the receive queue of
+ * the device when the listener sets busy_poll, and yielding in between keeps
+ * a CPU shared with other runnable threads usable.
+ * @return true if the client sent something, closed, or failed.
+ */
+static bool spin_for_data(struct thread_data *thread_data) {
+    uint64_t deadline;
+    ssize_t peeked;
+    char byte;
+
+    if (thread_data->spin_ns == 0)
+        return false;
+
+    deadline = monotonic_ns() + thread_data->spin_ns;
+    do {
+        peeked = recv(thread_data->client_fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+        if (peeked >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+            return true;
+        sched_yield();
+    } while (monotonic_ns() < deadline);
+
+    return false;
+}
+
+/*
+ * After a spin ran out, grow the budget if the client showed up soon after,
+ * shrink it if the wait was much longer anyway, the way KVM halt polling does.
+ */
+static void adapt_spin(struct thread_data *thread_data, uint64_t waited_ns) {
+    if (waited_ns <= SPIN_MAX_NS) {
+        thread_data->spin_ns = thread_data->spin_ns ? thread_data->spin_ns * 2 : SPIN_MIN_NS;
+        if (thread_data->spin_ns > SPIN_MAX_NS)
+            thread_data->spin_ns = SPIN_MAX_NS;
+    } else {
+        thread_data->spin_ns /= 2;
+        if (thread_data->spin_ns < SPIN_MIN_NS)
+            thread_data->spin_ns = 0;
+    }
+}
+
+static void finish_connection(struct thread_data *thread_data) {
+    // Closed under the list lock so that shutdown never touches a recycled descriptor
+    pthread_mutex_lock(&thread_list_mutex);
+    close(thread_data->client_fd);
+    thread_data->completed = true;
+    pthread_mutex_unlock(&thread_list_mutex);
+}
+
+void *connection_handler(void *arg) {
+    struct thread_data *thread_data = (struct thread_data *)arg;
+    char buffer[BUFFER_SIZE];
+    ssize_t bytes_received;
+    char *packet = NULL;
+    size_t packet_len = 0, packet_cap = 0;
+    bool draining = false;
+    struct pollfd fds[2] = {
+        { .fd = thread_data->client_fd, .events = POLLIN },
+        { .fd = stop_fd, .events = POLLIN },
+    };
+
+    AESD_LOG(LOG_INFO, LOG_TYPE_CONNECTION, "Accepted connection from %s", thread_data->peer);
+
+    timer_wheel_add(&timer_wheel, &thread_data->idle_timer, IDLE_TIMEOUT_MS, 0);
+
+    for (;;) {
+        char *newline;
+        size_t commit_len;
+        bool spin = cpu_pool_count > 0 && !draining && !atomic_load(&stopping);
+        uint64_t wait_start = 0;
+
+        if (spin) {
+            wait_start = monotonic_ns();
+            if (spin_for_data(thread_data))
+                goto receive;
         }
 
-        if (write(file_fd, buffer, bytes_received) == -1) {
-            syslog(LOG_ERR, "Error writing to file %s: %s", DATA_FILE, strerror(errno));
-            pthread_mutex_unlock(&file_mutex);
+        // Once draining, only the client matters: stop_fd stays readable from now on
+        if (poll(fds, draining ? 1 : 2, -1) == -1) {
+            if (errno == EINTR)
+                continue;
+            AESD_LOG(LOG_ERR, LOG_TYPE_CLIENT_IO, "Error polling client: %s", strerror(errno));
             break;
         }
+        if (spin)
+            adapt_spin(thread_data, monotonic_ns() - wait_start);
+        if (!draining && fds[1].revents)
+            draining = true;
+
+receive:
+        // Drain whatever the client already sent, and finish a partially received packet
+        bytes_received = recv(thread_data->client_fd, buffer, BUFFER_SIZE, draining ? MSG_DONTWAIT : 0);
+        if (bytes_received == -1 && (errno == EAGAIN || errno == EWOULDBLOCK) && packet_len > 0)
+            continue;
+        if (bytes_received <= 0)
+            break;
+
+        timer_wheel_add(&timer_wheel, &thread_data->idle_timer, IDLE_TIMEOUT_MS, 0);
 
-        pthread_mutex_unlock(&file_mutex);
+        // Packets are newline terminated and may span several recv() calls
+        if (packet_len + bytes_received > packet_cap) {
+            size_t new_cap = packet_cap ? packet_cap : BUFFER_SIZE;
+            char *new_packet;
 
-        // Read back entire file content and send to the client
-        pthread_mutex_lock(&file_mutex);
-        lseek(file_fd, 0, SEEK_SET);
-        while ((bytes_received = read(file_fd, buffer, BUFFER_SIZE)) > 0) {
-            if (send(thread_data->client_fd, buffer, bytes_received, 0) == -1) {
-                syslog(LOG_ERR, "Error sending data to client: %s", strerror(errno));
-                pthread_mutex_unlock(&file_mutex);
+            while (new_cap < packet_len + bytes_received)
+                new_cap *= 2;
+            new_packet = realloc(packet, new_cap);
+            if (!new_packet) {
+                AESD_LOG(LOG_ERR, LOG_TYPE_SERVER, "Error allocating memory for packet: %s", strerror(errno));
                 break;
             }
+            packet = new_packet;
+            packet_cap = new_cap;
         }
-        pthread_mutex_unlock(&file_mutex);
+        memcpy(packet + packet_len, buffer, bytes_received);
+        packet_len += bytes_received;
+
+        newline = memrchr(packet, '\n', packet_len);
+        if (!newline)
+            continue;
+
+        commit_len = newline - packet + 1;
+        if (process_packets(thread_data, packet, commit_len) == -1)
+            break;
+        packet_len -= commit_len;
+        memmove(packet, packet + commit_len, packet_len);
     }
 
-    if (file_fd != -1) close(file_fd);
+    timer_wheel_cancel(&timer_wheel, &thread_data->idle_timer);
+    free(packet);
 
-    syslog(LOG_INFO, "Closed connection from %s", inet_ntoa(thread_data->client_addr.sin_addr));
-    close(thread_data->client_fd);
-    thread_data->completed = true;
+    AESD_LOG(LOG_INFO, LOG_TYPE_CONNECTION, "Closed connection from %s", thread_data->peer);
+    finish_connection(thread_data);
+    return NULL;
+}
+
+void *replication_handler(void *arg) {
+    struct thread_data *thread_data = (struct thread_data *)arg;
+
+    AESD_LOG(LOG_INFO, LOG_TYPE_CONNECTION, "Accepted replication stream from %s", thread_data->peer);
+    replica_serve(&replica, thread_data->client_fd, stop_fd, thread_data->peer);
+    AESD_LOG(LOG_INFO, LOG_TYPE_CONNECTION, "Closed replication stream from %s", thread_data->peer);
+    finish_connection(thread_data);
     return NULL;
 }
 
@@ -109,7 +463,8 @@ void cleanup_threads() {
 
     while (current) {
         if (current->data->completed) {
-            pthread_join(current->data->thread_id, NULL);
+            tp_future_get(current->data->future);
+            tp_future_release(current->data->future);
             free(current->data);
             struct thread_node *to_delete = current;
             if (prev) {
@@ -128,105 +483,539 @@ void cleanup_threads() {
     pthread_mutex_unlock(&thread_list_mutex);
 }
 
-int main(int argc, char *argv[]) {
-    int server_fd, client_fd;
-    struct sockaddr_in server_addr, client_addr;
+static long monotonic_ms() {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000L + now.tv_nsec / 1000000L;
+}
+
+/*
+ * Wait for every connection to drain, up to SHUTDOWN_DRAIN_MS, then force
+ * the stragglers off their sockets and wait for them all.
+ */
+static void join_all_threads() {
+    long deadline = monotonic_ms() + SHUTDOWN_DRAIN_MS;
+    struct thread_node *current;
+
+    pthread_mutex_lock(&thread_list_mutex);
+    for (current = thread_list_head; current; current = current->next) {
+        long remaining = deadline - monotonic_ms();
+
+        pthread_mutex_unlock(&thread_list_mutex);
+        if (tp_future_wait(current->data->future, remaining > 0 ? remaining : 0))
+            current->data->joined = true;
+        pthread_mutex_lock(&thread_list_mutex);
+
+        if (!current->data->joined && !current->data->completed) {
+            AESD_LOG(LOG_WARNING, LOG_TYPE_CONNECTION, "Connection from %s still busy after %d ms, closing it",
+                     current->data->peer, SHUTDOWN_DRAIN_MS);
+            shutdown(current->data->client_fd, SHUT_RDWR);
+        }
+    }
+    pthread_mutex_unlock(&thread_list_mutex);
+
+    // New nodes are only added by the main thread, so the list is stable here
+    while ((current = thread_list_head)) {
+        if (!current->data->joined)
+            tp_future_wait(current->data->future, -1);
+        tp_future_release(current->data->future);
+        thread_list_head = current->next;
+        free(current->data);
+        free(current);
+    }
+}
+
+/*
+ * Threads don't survive fork(), so the log drainer and the commit threads of
+ * the history start in the daemon. The parent waits on this pipe until the
+ * daemon reports it started, or exits without doing so, and exits with the
+ * matching status.
+ */
+static void daemonize() {
+    int status_pipe[2], null_fd;
+    char started;
+    ssize_t len;
+    pid_t pid;
+
+    if (pipe2(status_pipe, O_CLOEXEC) == -1) {
+        syslog(LOG_ERR, "Error creating startup pipe: %s", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    pid = fork();
+    if (pid == -1) {
+        syslog(LOG_ERR, "Error forking daemon: %s", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    if (pid > 0) {
+        close(status_pipe[1]);
+        // End of file: the daemon exited before reporting
+        do {
+            len = read(status_pipe[0], &started, 1);
+        } while (len == -1 && errno == EINTR);
+        if (len == 1)
+            exit(EXIT_SUCCESS);
+        fprintf(stderr, "aesdsocket failed to start, see the system log\n");
+        exit(EXIT_FAILURE);
+    }
+    close(status_pipe[0]);
+    startup_fd = status_pipe[1];
+
+    if (setsid() == -1) {
+        syslog(LOG_ERR, "Error creating session: %s", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    if (chdir("/") == -1) {
+        syslog(LOG_ERR, "Error changing directory: %s", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    null_fd = open("/dev/null", O_RDWR);
+    if (null_fd != -1) {
+        dup2(null_fd, STDIN_FILENO);
+        dup2(null_fd, STDOUT_FILENO);
+        dup2(null_fd, STDERR_FILENO);
+        if (null_fd > STDERR_FILENO)
+            close(null_fd);
+    }
+}
+
+/*
+ * In low latency mode, the pool pinned to the CPU that received the packets of
+ * @param client_fd, so its worker finds them in cache and wakes up on that CPU.
+ */
+static struct thread_pool *connection_pool_for(int client_fd) {
+    int cpu, i;
+    socklen_t len = sizeof(cpu);
+
+    if (cpu_pool_count == 0)
+        return &connection_pool;
+
+    if (getsockopt(client_fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) == 0 && cpu >= 0) {
+        for (i = 0; i < cpu_pool_count; i++) {
+            if (cpu_pools[i].cpu == cpu)
+                return &cpu_pools[i].pool;
+        }
+    }
+
+    // Local sockets, or packets steered to a CPU without workers
+    return &cpu_pools[cpu_pool_next++ % cpu_pool_count].pool;
+}
+
+/*
+ * Start @param handler on a connection accepted from @param listener, on the
+ * pool of its CPU when @param steer and in low latency mode.
+ */
+static void accept_connection(const struct listener *listener, void *(*handler)(void *), bool steer) {
+    int client_fd;
+    struct sockaddr_storage client_addr;
     socklen_t client_addr_len = sizeof(client_addr);
-    struct sigaction sa;
+
+    client_fd = accept4(listener->fd, (struct sockaddr *)&client_addr, &client_addr_len, SOCK_CLOEXEC);
+    if (client_fd == -1) {
+        if (errno != EAGAIN && errno != EINTR)
+            AESD_LOG(LOG_ERR, LOG_TYPE_CONNECTION, "Error accepting connection: %s", strerror(errno));
+        return;
+    }
+    listener_setup_client(&listener->config, client_fd);
+
+    struct thread_data *new_thread_data = malloc(sizeof(struct thread_data));
+    if (!new_thread_data) {
+        AESD_LOG(LOG_ERR, LOG_TYPE_SERVER, "Error allocating memory for thread data: %s", strerror(errno));
+        close(client_fd);
+        return;
+    }
+
+    new_thread_data->client_fd = client_fd;
+    new_thread_data->client_addr = client_addr;
+    new_thread_data->store = channel_default(&channels);
+    listener_format_peer(&client_addr, new_thread_data->peer, sizeof(new_thread_data->peer));
+    new_thread_data->spin_ns = SPIN_START_NS;
+    new_thread_data->warned_read_only = false;
+    new_thread_data->completed = false;
+    new_thread_data->joined = false;
+    tw_timer_init(&new_thread_data->idle_timer, idle_timeout, new_thread_data);
+
+    pthread_mutex_lock(&thread_list_mutex);
+    struct thread_node *new_node = malloc(sizeof(struct thread_node));
+    if (!new_node) {
+        AESD_LOG(LOG_ERR, LOG_TYPE_SERVER, "Error allocating memory for thread node: %s", strerror(errno));
+        close(client_fd);
+        free(new_thread_data);
+        pthread_mutex_unlock(&thread_list_mutex);
+        return;
+    }
+
+    new_node->data = new_thread_data;
+    new_node->next = thread_list_head;
+    thread_list_head = new_node;
+    pthread_mutex_unlock(&thread_list_mutex);
+
+    new_thread_data->future = thread_pool_submit_future(steer ? connection_pool_for(client_fd) : &connection_pool,
+                                                        handler, new_thread_data);
+    if (!new_thread_data->future) {
+        AESD_LOG(LOG_ERR, LOG_TYPE_SERVER, "Error queueing connection: %s", strerror(errno));
+        close(client_fd);
+        pthread_mutex_lock(&thread_list_mutex);
+        thread_list_head = thread_list_head->next;
+        free(new_node);
+        free(new_thread_data);
+        pthread_mutex_unlock(&thread_list_mutex);
+        return;
+    }
+
+    atomic_fetch_add(&metrics.connections, 1);
+}
+
+static int epoll_add(int epoll_fd, int fd) {
+    struct epoll_event ev = {
+        .events = EPOLLIN,
+        .data.fd = fd,
+    };
+
+    return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-d] [-l listener]... [-c listener_file] [-u socket_path|@abstract_name]"
+                    " [-o log_file] [-p data_file] [-r follower | -R listener] [-C cpus]\n"
+                    "listener: ADDRESS[:PORT][,backlog=N][,rcvbuf=N][,sndbuf=N][,nodelay][,defer_accept=S]"
+                    "[,busy_poll=USECS][,v6only]\n"
+                    "ADDRESS: IPv4 address, [IPv6 address], * for dual stack, unix:PATH or unix:@NAME\n"
+                    "-r ships every commit to the follower at the given address, -R runs as a read only\n"
+                    "follower accepting the stream of a primary on the given listener\n"
+                    "-C runs connections on workers pinned to each CPU of the list (0-3,6), on the CPU\n"
+                    "their packets arrive on, spinning briefly before sleeping\n",
+            prog);
+    exit(EXIT_FAILURE);
+}
+
+// Parse a list of CPUs and ranges such as 0-3,6 into @param cpus
+static int parse_cpu_list(const char *list, cpu_set_t *cpus) {
+    long first, last;
+    char *end;
+
+    CPU_ZERO(cpus);
+    for (;;) {
+        first = strtol(list, &end, 10);
+        if (end == list || first < 0 || first >= CPU_SETSIZE)
+            return -1;
+        last = first;
+        if (*end == '-') {
+            list = end + 1;
+            last = strtol(list, &end, 10);
+            if (end == list || last < first || last >= CPU_SETSIZE)
+                return -1;
+        }
+        for (; first <= last; first++)
+            CPU_SET(first, cpus);
+
+        if (*end == '\0')
+            return 0;
+        if (*end != ',')
+            return -1;
+        list = end + 1;
+    }
+}
+
+// One pinned pool per CPU of @param cpus, for low latency mode
+static int start_cpu_pools(const cpu_set_t *cpus) {
+    int cpu;
+
+    if (CPU_COUNT(cpus) == 0)
+        return 0;
+
+    cpu_pools = calloc(CPU_COUNT(cpus), sizeof(*cpu_pools));
+    if (!cpu_pools)
+        return -1;
+
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, cpus))
+            continue;
+        cpu_pools[cpu_pool_count].cpu = cpu;
+        if (thread_pool_init_pinned(&cpu_pools[cpu_pool_count].pool, 1, CONNECTION_WORKERS_MAX, cpu) == -1) {
+            syslog(LOG_ERR, "Error pinning connection workers to CPU %d: %s", cpu, strerror(errno));
+            return -1;
+        }
+        cpu_pool_count++;
+    }
+
+    syslog(LOG_INFO, "Low latency mode on %d CPUs", cpu_pool_count);
+    return 0;
+}
+
+static void close_listeners() {
+    int i;
+
+    for (i = 0; i < listener_count; i++)
+        listener_close(&listeners[i]);
+    listener_close(&replication_listener);
+}
+
+int main(int argc, char *argv[]) {
+    int epoll_fd, signal_fd, opt, i;
+    struct listener_config configs[LISTENER_MAX];
+    int config_count = 0;
+    bool default_listener = true;
+    char unix_spec[PATH_MAX + 8];
+    sigset_t mask;
+    bool daemon_mode = false;
+    bool terminate = false;
+    const char *log_path = NULL;
+    const char *data_path = DATA_FILE;
+    struct listener_config follower;
+    bool primary = false;
+    struct epoll_event events[MAX_EVENTS];
+    struct tw_timer metrics_timer;
+    cpu_set_t pinned_cpus;
+#if !USE_AESD_CHAR_DEVICE
+    struct tw_timer timestamp_timer;
+#endif
+
+    CPU_ZERO(&pinned_cpus);
+    while ((opt = getopt(argc, argv, "dl:c:u:o:p:r:R:C:")) != -1) {
+        switch (opt) {
+        case 'd':
+            daemon_mode = true;
+            break;
+        case 'l':
+        case 'u':
+            if (config_count == LISTENER_MAX) {
+                fprintf(stderr, "At most %d listeners are supported\n", LISTENER_MAX);
+                exit(EXIT_FAILURE);
+            }
+            snprintf(unix_spec, sizeof(unix_spec), "unix:%s", optarg);
+            if (listener_parse(opt == 'u' ? unix_spec : optarg, &configs[config_count]) == -1)
+                usage(argv[0]);
+            config_count++;
+            // -u only adds a local socket next to the default TCP listener
+            if (opt == 'l')
+                default_listener = false;
+            break;
+        case 'o':
+            log_path = optarg;
+            break;
+        case 'p':
+            data_path = optarg;
+            break;
+        case 'r':
+            if (listener_parse(optarg, &follower) == -1)
+                usage(argv[0]);
+            primary = true;
+            break;
+        case 'R':
+            if (listener_parse(optarg, &replication_listener.config) == -1)
+                usage(argv[0]);
+            read_only = true;
+            break;
+        case 'C':
+            if (parse_cpu_list(optarg, &pinned_cpus) == -1) {
+                fprintf(stderr, "Invalid CPU list '%s'\n", optarg);
+                usage(argv[0]);
+            }
+            break;
+        case 'c':
+            if (listener_parse_file(optarg, configs, &config_count) == -1)
+                exit(EXIT_FAILURE);
+            default_listener = false;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    // Dual stack on port 9000 unless told otherwise
+    if (default_listener) {
+        if (config_count == LISTENER_MAX) {
+            fprintf(stderr, "At most %d listeners are supported\n", LISTENER_MAX);
+            exit(EXIT_FAILURE);
+        }
+        listener_parse("*", &configs[config_count++]);
+    }
 
     openlog("aesdsocket", LOG_PID | LOG_CONS, LOG_USER);
 
-    sa.sa_handler = handle_signal;
-    sigemptyset(&sa.sa_mask);
-    sa.sa_flags = 0;
-    if (sigaction(SIGINT, &sa, NULL) == -1 || sigaction(SIGTERM, &sa, NULL) == -1) {
-        syslog(LOG_ERR, "Error setting signal handler: %s", strerror(errno));
+    // Signals are consumed through a signalfd; blocked before any thread inherits the mask
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1) {
+        syslog(LOG_ERR, "Error blocking signals: %s", strerror(errno));
         exit(EXIT_FAILURE);
     }
 
-    if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
-        syslog(LOG_ERR, "Error creating socket: %s", strerror(errno));
+    for (i = 0; i < config_count; i++) {
+        listeners[i].config = configs[i];
+        listeners[i].fd = listener_open(&configs[i]);
+        listener_count++;
+        if (listeners[i].fd == -1) {
+            close_listeners();
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (read_only && (replication_listener.fd = listener_open(&replication_listener.config)) == -1) {
+        close_listeners();
         exit(EXIT_FAILURE);
     }
 
-    int opt = 1;
-    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) == -1) {
-        syslog(LOG_ERR, "Error setting socket options: %s", strerror(errno));
-        close(server_fd);
+    if ((signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC)) == -1 ||
+        (stop_fd = eventfd(0, EFD_CLOEXEC)) == -1) {
+        syslog(LOG_ERR, "Error creating shutdown descriptors: %s", strerror(errno));
+        close_listeners();
         exit(EXIT_FAILURE);
     }
 
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = htonl(INADDR_ANY);
-    server_addr.sin_port = htons(PORT);
+    if (timer_wheel_init(&timer_wheel, TIMER_TICK_MS) == -1) {
+        syslog(LOG_ERR, "Error creating timer: %s", strerror(errno));
+        close_listeners();
+        exit(EXIT_FAILURE);
+    }
 
-    if (bind(server_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) == -1) {
-        syslog(LOG_ERR, "Error binding socket: %s", strerror(errno));
-        close(server_fd);
+    if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1 ||
+        epoll_add(epoll_fd, timer_wheel_fd(&timer_wheel)) == -1) {
+        syslog(LOG_ERR, "Error setting up event loop: %s", strerror(errno));
+        close_listeners();
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < listener_count; i++) {
+        if (epoll_add(epoll_fd, listeners[i].fd) == -1) {
+            syslog(LOG_ERR, "Error setting up event loop: %s", strerror(errno));
+            close_listeners();
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (read_only && epoll_add(epoll_fd, replication_listener.fd) == -1) {
+        syslog(LOG_ERR, "Error setting up event loop: %s", strerror(errno));
+        close_listeners();
         exit(EXIT_FAILURE);
     }
 
-    if (listen(server_fd, BACKLOG) == -1) {
-        syslog(LOG_ERR, "Error listening on socket: %s", strerror(errno));
-        close(server_fd);
+    /*
+     * Fork only once bound and with every descriptor of the event loop created, so
+     * clients can already queue up. The parent exits once the daemon started.
+     */
+    if (daemon_mode)
+        daemonize();
+
+    // A signalfd wakes epoll for the signals of the process which added it, the daemon here
+    if (epoll_add(epoll_fd, signal_fd) == -1) {
+        syslog(LOG_ERR, "Error setting up event loop: %s", strerror(errno));
+        close_listeners();
         exit(EXIT_FAILURE);
     }
 
-    while (!terminate) {
-        client_fd = accept(server_fd, (struct sockaddr *)&client_addr, &client_addr_len);
-        if (client_fd == -1) {
-            if (terminate) break;  // Stop accepting if terminating
-            syslog(LOG_ERR, "Error accepting connection: %s", strerror(errno));
-            continue;
-        }
+    // The drainer thread has to be started after the fork, daemonize() waits for it
+    if (async_log_init(log_path) == -1) {
+        close_listeners();
+        exit(EXIT_FAILURE);
+    }
 
-        struct thread_data *new_thread_data = malloc(sizeof(struct thread_data));
-        if (!new_thread_data) {
-            syslog(LOG_ERR, "Error allocating memory for thread data: %s", strerror(errno));
-            close(client_fd);
-            continue;
+    // Channels are extra device minors when using the driver, which must already exist
+    if (channel_table_init(&channels, data_path, CHANNEL_SEPARATOR, !USE_AESD_CHAR_DEVICE) == -1) {
+        syslog(LOG_ERR, "Error opening history %s", data_path);
+        close_listeners();
+        exit(EXIT_FAILURE);
+    }
+    replica_init(&replica, &channels);
+
+    // Before the first commit, so the follower gets the whole history of this run
+    if (primary) {
+        if (replication_start(&replication, &follower) == -1) {
+            syslog(LOG_ERR, "Error starting replication: %s", strerror(errno));
+            close_listeners();
+            exit(EXIT_FAILURE);
         }
+        channel_table_set_commit_hook(&channels, replication_ship, &replication);
+    }
 
-        new_thread_data->client_fd = client_fd;
-        new_thread_data->client_addr = client_addr;
-        new_thread_data->completed = false;
+    // Workers inherit the blocked signal mask
+    if (thread_pool_init(&connection_pool, CONNECTION_WORKERS_MIN, CONNECTION_WORKERS_MAX) == -1 ||
+        start_cpu_pools(&pinned_cpus) == -1) {
+        syslog(LOG_ERR, "Error starting connection workers: %s", strerror(errno));
+        close_listeners();
+        exit(EXIT_FAILURE);
+    }
 
-        pthread_mutex_lock(&thread_list_mutex);
-        struct thread_node *new_node = malloc(sizeof(struct thread_node));
-        if (!new_node) {
-            syslog(LOG_ERR, "Error allocating memory for thread node: %s", strerror(errno));
-            close(client_fd);
-            free(new_thread_data);
-            pthread_mutex_unlock(&thread_list_mutex);
-            continue;
+    tw_timer_init(&metrics_timer, flush_metrics, NULL);
+    timer_wheel_add(&timer_wheel, &metrics_timer, METRICS_INTERVAL_MS, METRICS_INTERVAL_MS);
+#if !USE_AESD_CHAR_DEVICE
+    // A follower gets the timestamps of its primary
+    tw_timer_init(&timestamp_timer, append_timestamp, NULL);
+    if (!read_only)
+        timer_wheel_add(&timer_wheel, &timestamp_timer, TIMESTAMP_INTERVAL_MS, TIMESTAMP_INTERVAL_MS);
+#endif
+
+    // Everything that can fail has started, let the parent exit successfully
+    if (startup_fd != -1) {
+        char started = 1;
+
+        if (write(startup_fd, &started, 1) != 1)
+            AESD_LOG(LOG_WARNING, LOG_TYPE_SERVER, "Error reporting startup: %s", strerror(errno));
+        close(startup_fd);
+        startup_fd = -1;
+    }
+
+    while (!terminate) {
+        int j, nfds = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+        if (nfds == -1) {
+            if (errno == EINTR) continue;
+            AESD_LOG(LOG_ERR, LOG_TYPE_SERVER, "Error waiting for events: %s", strerror(errno));
+            break;
         }
 
-        new_node->data = new_thread_data;
-        new_node->next = thread_list_head;
-        thread_list_head = new_node;
-        pthread_mutex_unlock(&thread_list_mutex);
+        for (j = 0; j < nfds; j++) {
+            for (i = 0; i < listener_count; i++) {
+                if (events[j].data.fd == listeners[i].fd)
+                    break;
+            }
 
-        if (pthread_create(&new_thread_data->thread_id, NULL, connection_handler, new_thread_data) != 0) {
-            syslog(LOG_ERR, "Error creating thread: %s", strerror(errno));
-            close(client_fd);
-            pthread_mutex_lock(&thread_list_mutex);
-            thread_list_head = thread_list_head->next;
-            free(new_node);
-            free(new_thread_data);
-            pthread_mutex_unlock(&thread_list_mutex);
+            if (i < listener_count) {
+                accept_connection(&listeners[i], connection_handler, true);
+            } else if (events[j].data.fd == replication_listener.fd) {
+                accept_connection(&replication_listener, replication_handler, false);
+            } else if (events[j].data.fd == signal_fd) {
+                struct signalfd_siginfo info;
+                if (read(signal_fd, &info, sizeof(info)) == sizeof(info)) {
+                    AESD_LOG(LOG_INFO, LOG_TYPE_SERVER, "Caught signal, exiting");
+                    terminate = true;
+                }
+            } else {
+                timer_wheel_run(&timer_wheel);
+            }
         }
-    }
 
-    close(server_fd);
+        cleanup_threads();
+    }
 
-    cleanup_threads();
-    pthread_mutex_destroy(&file_mutex);
+    // Stop accepting first, then let every connection finish its in-flight packets
+    close_listeners();
+    atomic_store(&stopping, true);
+    eventfd_write(stop_fd, 1);
+    join_all_threads();
+    thread_pool_destroy(&connection_pool);
+    for (i = 0; i < cpu_pool_count; i++)
+        thread_pool_destroy(&cpu_pools[i].pool);
+    free(cpu_pools);
+
+    close(epoll_fd);
+    close(signal_fd);
+    close(stop_fd);
+#if !USE_AESD_CHAR_DEVICE
+    timer_wheel_cancel(&timer_wheel, &timestamp_timer);
+#endif
+    timer_wheel_cancel(&timer_wheel, &metrics_timer);
+    timer_wheel_destroy(&timer_wheel);
+    // The commit threads flush into the replication hook, stop them first
+    channel_table_destroy(&channels);
+    if (primary)
+        replication_stop(&replication);
+    replica_destroy(&replica);
     pthread_mutex_destroy(&thread_list_mutex);
 
+    async_log_shutdown();
     syslog(LOG_INFO, "Exiting aesdsocket");
     closelog();
 
     return 0;
 }
-
@@ -0,0 +1,279 @@
+/**
+ * @file async-log.c
+ * @brief Per thread lock free log rings drained by a background thread
+ *
+ * Every logging thread claims a single producer/single consumer ring the
+ * first time it logs. Rings are never freed: when a thread exits its ring is
+ * released for reuse by the next new thread, so the registry only grows up to
+ * the largest number of threads that were ever logging at the same time.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "async-log.h"
+
+#define ASYNC_LOG_RING_MASK (ASYNC_LOG_RING_SLOTS - 1)
+#define ASYNC_LOG_DRAIN_INTERVAL_MS 50
+#define CACHE_LINE_SIZE 64
+
+_Static_assert((ASYNC_LOG_RING_SLOTS & ASYNC_LOG_RING_MASK) == 0, "ring slots must be a power of two");
+
+struct log_entry {
+    int level;
+    struct timespec time;
+    char msg[ASYNC_LOG_MSG_MAX];
+};
+
+struct log_ring {
+    /**
+     * Next slot to fill, only written by the owning thread
+     */
+    _Alignas(CACHE_LINE_SIZE) atomic_uint head;
+    /**
+     * Next slot to drain, only written by the drainer
+     */
+    _Alignas(CACHE_LINE_SIZE) atomic_uint tail;
+    _Alignas(CACHE_LINE_SIZE) atomic_bool in_use;
+    atomic_ulong dropped;
+    struct log_ring *next;
+    struct log_entry entries[ASYNC_LOG_RING_SLOTS];
+};
+
+/*
+ * Fixed one second window per message type. Bursts beyond the limit are
+ * counted and reported by the drainer instead of being logged.
+ */
+struct rate_limit {
+    atomic_ullong window;
+    atomic_uint count;
+    atomic_ulong suppressed;
+};
+
+static const unsigned int rate_limits[LOG_TYPE_COUNT] = {
+    [LOG_TYPE_CONNECTION] = 200,
+    [LOG_TYPE_DATA] = 50,
+    [LOG_TYPE_CLIENT_IO] = 50,
+    [LOG_TYPE_SERVER] = 100,
+};
+
+static const char *const type_names[LOG_TYPE_COUNT] = {
+    [LOG_TYPE_CONNECTION] = "connection",
+    [LOG_TYPE_DATA] = "data",
+    [LOG_TYPE_CLIENT_IO] = "client I/O",
+    [LOG_TYPE_SERVER] = "server",
+};
+
+static struct rate_limit rate_state[LOG_TYPE_COUNT];
+
+static _Atomic(struct log_ring *) ring_registry = NULL;
+static __thread struct log_ring *local_ring = NULL;
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+
+static pthread_t drainer;
+static atomic_bool running = false;
+static atomic_bool stopping = false;
+static FILE *log_file = NULL;
+
+static void release_ring(void *ring) {
+    atomic_store_explicit(&((struct log_ring *)ring)->in_use, false, memory_order_release);
+}
+
+static void make_ring_key() {
+    pthread_key_create(&ring_key, release_ring);
+}
+
+static struct log_ring *claim_ring() {
+    struct log_ring *ring;
+
+    for (ring = atomic_load(&ring_registry); ring; ring = ring->next) {
+        bool expected = false;
+        if (atomic_compare_exchange_strong(&ring->in_use, &expected, true))
+            goto claimed;
+    }
+
+    ring = aligned_alloc(CACHE_LINE_SIZE, sizeof(struct log_ring));
+    if (!ring)
+        return NULL;
+    memset(ring, 0, sizeof(struct log_ring));
+    atomic_store(&ring->in_use, true);
+
+    ring->next = atomic_load(&ring_registry);
+    while (!atomic_compare_exchange_weak(&ring_registry, &ring->next, ring))
+        ;
+
+claimed:
+    pthread_once(&ring_key_once, make_ring_key);
+    pthread_setspecific(ring_key, ring);
+    return ring;
+}
+
+static bool rate_limit_allow(enum log_type type) {
+    struct rate_limit *limit = &rate_state[type];
+    struct timespec now;
+    unsigned long long window;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    window = atomic_load_explicit(&limit->window, memory_order_relaxed);
+    if (window != (unsigned long long)now.tv_sec &&
+        atomic_compare_exchange_strong(&limit->window, &window, now.tv_sec))
+        atomic_store_explicit(&limit->count, 0, memory_order_relaxed);
+
+    if (atomic_fetch_add_explicit(&limit->count, 1, memory_order_relaxed) < rate_limits[type])
+        return true;
+
+    atomic_fetch_add_explicit(&limit->suppressed, 1, memory_order_relaxed);
+    return false;
+}
+
+void async_log(int level, enum log_type type, const char *fmt, ...) {
+    struct log_ring *ring;
+    struct log_entry *entry;
+    unsigned int head, tail;
+    va_list args;
+
+    if (!rate_limit_allow(type))
+        return;
+
+    va_start(args, fmt);
+    if (!atomic_load_explicit(&running, memory_order_acquire)) {
+        vsyslog(level, fmt, args);
+        va_end(args);
+        return;
+    }
+
+    ring = local_ring;
+    if (!ring)
+        ring = local_ring = claim_ring();
+    if (!ring) {
+        va_end(args);
+        return;
+    }
+
+    head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (head - tail == ASYNC_LOG_RING_SLOTS) {
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        va_end(args);
+        return;
+    }
+
+    entry = &ring->entries[head & ASYNC_LOG_RING_MASK];
+    entry->level = level;
+    clock_gettime(CLOCK_REALTIME, &entry->time);
+    vsnprintf(entry->msg, sizeof(entry->msg), fmt, args);
+    va_end(args);
+
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+static void emit(int level, const struct timespec *time, const char *msg) {
+    char stamp[32];
+    struct tm tm;
+
+    if (!log_file) {
+        syslog(level, "%s", msg);
+        return;
+    }
+
+    localtime_r(&time->tv_sec, &tm);
+    strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm);
+    fprintf(log_file, "%s.%03ld aesdsocket[%d]: %s\n", stamp, time->tv_nsec / 1000000, getpid(), msg);
+}
+
+static void drain_all() {
+    struct log_ring *ring;
+    struct timespec now;
+    unsigned long count;
+    char msg[ASYNC_LOG_MSG_MAX];
+    int type;
+
+    for (ring = atomic_load(&ring_registry); ring; ring = ring->next) {
+        unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        unsigned int head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+        for (; tail != head; tail++) {
+            struct log_entry *entry = &ring->entries[tail & ASYNC_LOG_RING_MASK];
+            emit(entry->level, &entry->time, entry->msg);
+        }
+        atomic_store_explicit(&ring->tail, tail, memory_order_release);
+
+        if ((count = atomic_exchange_explicit(&ring->dropped, 0, memory_order_relaxed))) {
+            clock_gettime(CLOCK_REALTIME, &now);
+            snprintf(msg, sizeof(msg), "Log ring full, dropped %lu messages", count);
+            emit(LOG_WARNING, &now, msg);
+        }
+    }
+
+    for (type = 0; type < LOG_TYPE_COUNT; type++) {
+        if ((count = atomic_exchange_explicit(&rate_state[type].suppressed, 0, memory_order_relaxed))) {
+            clock_gettime(CLOCK_REALTIME, &now);
+            snprintf(msg, sizeof(msg), "Rate limit suppressed %lu %s messages", count, type_names[type]);
+            emit(LOG_WARNING, &now, msg);
+        }
+    }
+
+    if (log_file)
+        fflush(log_file);
+}
+
+static void *drainer_thread(void *arg) {
+    struct timespec interval = {
+        .tv_sec = 0,
+        .tv_nsec = ASYNC_LOG_DRAIN_INTERVAL_MS * 1000000L,
+    };
+
+    while (!atomic_load(&stopping)) {
+        drain_all();
+        nanosleep(&interval, NULL);
+    }
+    drain_all();
+    return NULL;
+}
+
+int async_log_init(const char *path) {
+    if (path) {
+        log_file = fopen(path, "a");
+        if (!log_file) {
+            syslog(LOG_ERR, "Error opening log file %s: %m", path);
+            return -1;
+        }
+    }
+
+    atomic_store(&stopping, false);
+    if (pthread_create(&drainer, NULL, drainer_thread, NULL) != 0) {
+        syslog(LOG_ERR, "Error creating log thread");
+        if (log_file) {
+            fclose(log_file);
+            log_file = NULL;
+        }
+        return -1;
+    }
+
+    atomic_store_explicit(&running, true, memory_order_release);
+    return 0;
+}
+
+void async_log_shutdown(void) {
+    if (!atomic_load(&running))
+        return;
+
+    atomic_store(&stopping, true);
+    pthread_join(drainer, NULL);
+    // Late messages from here on go straight to syslog
+    atomic_store_explicit(&running, false, memory_order_release);
+    drain_all();
+
+    if (log_file) {
+        fclose(log_file);
+        log_file = NULL;
+    }
+}
@@ -0,0 +1,61 @@
+/*
+ * async-log.h
+ *
+ * Non blocking logging for aesdsocket. Each thread formats its messages into
+ * its own single producer ring, which a background thread drains into syslog
+ * or a log file, so a connection thread never waits on the logger.
+ */
+
+#ifndef ASYNC_LOG_H
+#define ASYNC_LOG_H
+
+#include <syslog.h>
+
+/**
+ * Messages less important than this syslog level are compiled out entirely.
+ * Override with -DAESD_LOG_LEVEL=LOG_DEBUG in CFLAGS.
+ */
+#ifndef AESD_LOG_LEVEL
+#define AESD_LOG_LEVEL LOG_INFO
+#endif
+
+#define ASYNC_LOG_RING_SLOTS 64
+#define ASYNC_LOG_MSG_MAX 240
+
+/**
+ * Message categories, each with its own per second rate limit
+ */
+enum log_type {
+    LOG_TYPE_CONNECTION,
+    LOG_TYPE_DATA,
+    LOG_TYPE_CLIENT_IO,
+    LOG_TYPE_SERVER,
+    LOG_TYPE_COUNT
+};
+
+#define AESD_LOG(level, type, fmt, ...) \
+    do { \
+        if ((level) <= AESD_LOG_LEVEL) \
+            async_log((level), (type), fmt, ##__VA_ARGS__); \
+    } while (0)
+
+/**
+ * Start the drainer thread. Messages go to @param path when set, syslog otherwise.
+ * Until this is called, async_log() writes straight to syslog.
+ * @return 0 on success, -1 on error.
+ */
+int async_log_init(const char *path);
+
+/**
+ * Flush every pending message and stop the drainer thread.
+ */
+void async_log_shutdown(void);
+
+/**
+ * Queue a message from the calling thread. Never blocks: a message is dropped, and
+ * the drop counted, when its type exceeds its rate limit or the thread's ring is full.
+ */
+void async_log(int level, enum log_type type, const char *fmt, ...)
+    __attribute__((format(printf, 3, 4)));
+
+#endif /* ASYNC_LOG_H */
@@ -0,0 +1,186 @@
+/**
+ * @file latency-bench.c
+ * @brief Request latency of aesdsocket, one client sending packets in turn
+ *
+ * Each iteration sends one short packet and reads the readback up to the end
+ * of that packet, which ends the history. It records the time to the first
+ * byte of the readback, which is mostly the wake up of the connection, and to
+ * its last byte, then prints percentiles of both. A pause between packets
+ * shows how the spin budget of the low latency mode adapts to slower clients.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#define READ_BUFFER_SIZE (64 * 1024)
+
+static uint64_t now_ns() {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void report(const char *what, uint64_t *samples, size_t count) {
+    qsort(samples, count, sizeof(*samples), compare_u64);
+    printf("%-12s p50 %8.1f us  p90 %8.1f us  p99 %8.1f us  max %8.1f us\n", what,
+           samples[count / 2] / 1000.0, samples[count * 90 / 100] / 1000.0,
+           samples[count * 99 / 100] / 1000.0, samples[count - 1] / 1000.0);
+}
+
+static int connect_to(const char *host, const char *port) {
+    struct addrinfo hints = { .ai_socktype = SOCK_STREAM }, *addrs, *addr;
+    int fd = -1, one = 1, err;
+
+    err = getaddrinfo(host, port, &hints, &addrs);
+    if (err) {
+        fprintf(stderr, "%s:%s: %s\n", host, port, gai_strerror(err));
+        return -1;
+    }
+    for (addr = addrs; addr; addr = addr->ai_next) {
+        fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+        if (fd == -1)
+            continue;
+        if (connect(fd, addr->ai_addr, addr->ai_addrlen) == 0)
+            break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(addrs);
+
+    if (fd == -1) {
+        fprintf(stderr, "Error connecting to %s:%s: %s\n", host, port, strerror(errno));
+        return -1;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-h host] [-p port] [-n iterations] [-w warmup] [-t pause_us] [-c channel]\n",
+            prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    const char *host = "127.0.0.1", *port = "9000", *channel = NULL;
+    long iterations = 10000, warmup = 1000, pause_us = 0, i;
+    uint64_t *first_byte, *round_trip;
+    static char buffer[READ_BUFFER_SIZE];
+    char packet[64];
+    int fd, opt;
+
+    while ((opt = getopt(argc, argv, "h:p:n:w:t:c:")) != -1) {
+        switch (opt) {
+        case 'h':
+            host = optarg;
+            break;
+        case 'p':
+            port = optarg;
+            break;
+        case 'n':
+            iterations = strtol(optarg, NULL, 10);
+            break;
+        case 'w':
+            warmup = strtol(optarg, NULL, 10);
+            break;
+        case 't':
+            pause_us = strtol(optarg, NULL, 10);
+            break;
+        case 'c':
+            channel = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (iterations < 1 || warmup < 0 || pause_us < 0)
+        usage(argv[0]);
+
+    first_byte = calloc(iterations, sizeof(*first_byte));
+    round_trip = calloc(iterations, sizeof(*round_trip));
+    if (!first_byte || !round_trip) {
+        perror("calloc");
+        return EXIT_FAILURE;
+    }
+
+    fd = connect_to(host, port);
+    if (fd == -1)
+        return EXIT_FAILURE;
+
+    // A channel of its own keeps the readback short when the history isn't empty
+    if (channel) {
+        int len = snprintf(packet, sizeof(packet), "AESD_CHANNEL %s\n", channel);
+
+        if (send(fd, packet, len, 0) != len) {
+            perror("send");
+            return EXIT_FAILURE;
+        }
+    }
+
+    for (i = -warmup; i < iterations; i++) {
+        int len = snprintf(packet, sizeof(packet), "ping %ld\n", i + warmup);
+        char tail[sizeof(packet)];
+        size_t seen = 0;
+        uint64_t start, first = 0;
+        ssize_t n;
+
+        if (pause_us)
+            usleep(pause_us);
+
+        start = now_ns();
+        if (send(fd, packet, len, 0) != len) {
+            perror("send");
+            return EXIT_FAILURE;
+        }
+
+        // The readback ends with the packet just sent, possibly split across reads
+        for (;;) {
+            n = recv(fd, buffer, sizeof(buffer), 0);
+            if (n <= 0) {
+                fprintf(stderr, "Connection lost after %ld packets\n", i + warmup);
+                return EXIT_FAILURE;
+            }
+            if (!first)
+                first = now_ns();
+
+            // Keep the last len bytes of the readback
+            if (n >= len) {
+                memcpy(tail, buffer + n - len, len);
+            } else {
+                memmove(tail, tail + n, len - n);
+                memcpy(tail + len - n, buffer, n);
+            }
+            seen += n;
+            if (seen >= (size_t)len && memcmp(tail, packet, len) == 0)
+                break;
+        }
+
+        if (i >= 0) {
+            round_trip[i] = now_ns() - start;
+            first_byte[i] = first - start;
+        }
+    }
+    close(fd);
+
+    report("first byte", first_byte, iterations);
+    report("round trip", round_trip, iterations);
+    free(first_byte);
+    free(round_trip);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,42 @@
+#!/bin/sh
+# Run latency-bench against aesdsocket-bench in its blocking mode, then in its low
+# latency mode. Settings come from the environment, see the Makefile.
+
+PORT=${PORT:-9100}
+CPUS=${CPUS:-0}
+BUSY_POLL=${BUSY_POLL:-50}
+ITERATIONS=${ITERATIONS:-20000}
+PAUSE_US=${PAUSE_US:-0}
+
+cd "$(dirname "$0")"
+data=$(mktemp)
+trap 'rm -f "$data"' EXIT
+
+# @param mode name printed before the results
+# @param listener option of -l
+# Other parameters go to aesdsocket-bench
+run() {
+    mode=$1
+    listener=$2
+    shift 2
+
+    : > "$data"
+    ./aesdsocket-bench -l "$listener" -p "$data" "$@" &
+    server=$!
+    # Wait for the listener
+    for i in $(seq 50); do
+        ./latency-bench -p "$PORT" -n 1 -w 0 > /dev/null 2>&1 && break
+        sleep 0.1
+    done
+
+    echo "$mode"
+    ./latency-bench -p "$PORT" -n "$ITERATIONS" -t "$PAUSE_US"
+    status=$?
+
+    kill -TERM "$server"
+    wait "$server"
+    return $status
+}
+
+run "blocking" "127.0.0.1:$PORT,nodelay" || exit 1
+run "low latency, CPUs $CPUS, busy_poll $BUSY_POLL us" "127.0.0.1:$PORT,nodelay,busy_poll=$BUSY_POLL" -C "$CPUS"
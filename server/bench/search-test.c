@@ -0,0 +1,115 @@
+/**
+ * @file search-test.c
+ * @brief Checks search_find() against glibc memmem() on random inputs
+ *
+ * Haystacks and needles are drawn from a small alphabet so candidate
+ * positions, partial matches and matches near the end are common. Every
+ * buffer is allocated at its exact size, so under AddressSanitizer a vector
+ * load past the end of the haystack fails the test as well.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "search.h"
+
+#define ROUNDS 200000
+#define HAYSTACK_MAX 96
+#define NEEDLE_MAX 24
+
+static unsigned long long rng_state = 0x9e3779b97f4a7c15ULL;
+
+static unsigned long long rng_next() {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545f4914f6cdd1dULL;
+}
+
+static void fill(char *buf, size_t len, unsigned int alphabet) {
+    size_t i;
+
+    for (i = 0; i < len; i++)
+        buf[i] = 'a' + rng_next() % alphabet;
+}
+
+static int check(const char *haystack, size_t haystack_len, const char *needle, size_t needle_len) {
+    const char *expected = memmem(haystack, haystack_len, needle, needle_len);
+    const char *found = search_find(haystack, haystack_len, needle, needle_len);
+
+    if (found == expected)
+        return 0;
+    fprintf(stderr, "search-test: haystack '%.*s' needle '%.*s': expected offset %ld, got %ld\n",
+            (int)haystack_len, haystack, (int)needle_len, needle,
+            expected ? (long)(expected - haystack) : -1L, found ? (long)(found - haystack) : -1L);
+    return -1;
+}
+
+// Copies of @param haystack and @param needle at their exact size
+static int check_copy(const char *haystack, size_t haystack_len, const char *needle, size_t needle_len) {
+    char *h = malloc(haystack_len ? haystack_len : 1), *n = malloc(needle_len ? needle_len : 1);
+    int rc;
+
+    memcpy(h, haystack, haystack_len);
+    memcpy(n, needle, needle_len);
+    rc = check(h, haystack_len, n, needle_len);
+    free(h);
+    free(n);
+    return rc;
+}
+
+static int check_edges() {
+    static const char text[] = "0123456789abcdefghijklmnopqrstuvwxyz0123456789ABCDEF";
+    size_t len = strlen(text), i;
+    int rc = 0;
+
+    rc |= check_copy(text, len, "", 0);
+    rc |= check_copy("", 0, "x", 1);
+    // Needle longer than the haystack, equal to it, and one byte short of it
+    rc |= check_copy(text, 10, text, 11);
+    rc |= check_copy(text, len, text, len);
+    rc |= check_copy(text, len, text + 1, len - 1);
+    rc |= check_copy(text, len, text, len - 1);
+    // One byte needles and matches in the last 16 bytes, where the vector loop stops
+    for (i = 0; i < len; i++) {
+        rc |= check_copy(text, len, text + i, 1);
+        rc |= check_copy(text, len, text + i, len - i);
+        rc |= check_copy(text, len, text + i, len - i < 4 ? len - i : 4);
+    }
+    // Both end bytes line up but the middle doesn't
+    rc |= check_copy(text, len, "0x9", 3);
+    return rc;
+}
+
+static int check_random() {
+    char haystack[HAYSTACK_MAX], needle[NEEDLE_MAX];
+    unsigned int round;
+
+    for (round = 0; round < ROUNDS; round++) {
+        size_t haystack_len = rng_next() % (HAYSTACK_MAX + 1);
+        size_t needle_len = 1 + rng_next() % NEEDLE_MAX;
+        unsigned int alphabet = 1 + rng_next() % 4;
+
+        fill(haystack, haystack_len, alphabet);
+        // Half the needles are cut from the haystack, so most of those match
+        if (haystack_len >= needle_len && rng_next() % 2) {
+            memcpy(needle, haystack + rng_next() % (haystack_len - needle_len + 1), needle_len);
+            if (rng_next() % 4 == 0)
+                needle[rng_next() % needle_len] ^= 1;
+        } else {
+            fill(needle, needle_len, alphabet);
+        }
+        if (check_copy(haystack, haystack_len, needle, needle_len) == -1)
+            return -1;
+    }
+    return 0;
+}
+
+int main() {
+    if (check_edges() == -1 || check_random() == -1)
+        return EXIT_FAILURE;
+    printf("search-test: edge cases and %d random searches match memmem\n", ROUNDS);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,178 @@
+/**
+ * @file channel.c
+ * @brief Independent named histories of aesdsocket
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdatomic.h>
+
+#include "async-log.h"
+#include "channel.h"
+
+static bool valid_name(const char *name, size_t len) {
+    size_t i;
+
+    if (len == 0 || len > CHANNEL_NAME_MAX)
+        return false;
+    for (i = 0; i < len; i++) {
+        char c = name[i];
+        if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '-' || c == '_'))
+            return false;
+    }
+    return true;
+}
+
+// Minors of the driver are numbered from 1 after the default one, /dev/aesdchar1 and up
+static bool valid_minor(const char *name, size_t len) {
+    size_t i;
+
+    if (name[0] == '0')
+        return false;
+    for (i = 0; i < len; i++) {
+        if (name[i] < '0' || name[i] > '9')
+            return false;
+    }
+    return true;
+}
+
+static void channel_commit(void *arg, const struct iovec *iov, int count) {
+    struct channel *channel = arg;
+
+    channel->table->commit_hook(channel->table->commit_hook_arg, channel->name, iov, count);
+}
+
+static void channel_set_hook(struct channel *channel) {
+    channel->store.commit_hook = channel->table->commit_hook ? channel_commit : NULL;
+    channel->store.commit_hook_arg = channel;
+}
+
+static struct channel *channel_open(struct channel_table *table, const char *name, size_t len) {
+    struct channel *channel;
+    char path[PATH_MAX];
+    int path_len;
+
+    path_len = snprintf(path, sizeof(path), "%s%s%.*s", table->base_path, len ? table->separator : "",
+                        (int)len, name);
+    if (path_len < 0 || (size_t)path_len >= sizeof(path)) {
+        AESD_LOG(LOG_ERR, LOG_TYPE_DATA, "Path of channel %.*s is too long", (int)len, name);
+        return NULL;
+    }
+
+    // store_init() creates missing files, which must not happen to device nodes
+    if (!table->create && access(path, W_OK) == -1) {
+        AESD_LOG(LOG_ERR, LOG_TYPE_DATA, "Channel %.*s is not available at %s: %s", (int)len, name, path,
+                 strerror(errno));
+        return NULL;
+    }
+
+    channel = calloc(1, sizeof(struct channel));
+    if (!channel) {
+        AESD_LOG(LOG_ERR, LOG_TYPE_SERVER, "Error allocating memory for channel: %s", strerror(errno));
+        return NULL;
+    }
+    memcpy(channel->name, name, len);
+    channel->table = table;
+
+    if (store_init(&channel->store, path) == -1) {
+        AESD_LOG(LOG_ERR, LOG_TYPE_DATA, "Error starting commit thread for %s", path);
+        free(channel);
+        return NULL;
+    }
+    // Nothing was committed yet, the channel isn't in the table
+    channel_set_hook(channel);
+    return channel;
+}
+
+int channel_table_init(struct channel_table *table, const char *base_path, const char *separator, bool create) {
+    memset(table, 0, sizeof(struct channel_table));
+    snprintf(table->base_path, sizeof(table->base_path), "%s", base_path);
+    snprintf(table->separator, sizeof(table->separator), "%s", separator);
+    // Without the driver loaded, the default channel fails the start like any other
+    table->create = create;
+
+    table->channels[0] = channel_open(table, "", 0);
+    if (!table->channels[0])
+        return -1;
+    table->count = 1;
+
+    pthread_mutex_init(&table->lock, NULL);
+    return 0;
+}
+
+void channel_table_set_commit_hook(struct channel_table *table, channel_commit_hook hook, void *arg) {
+    int i;
+
+    pthread_mutex_lock(&table->lock);
+    table->commit_hook = hook;
+    table->commit_hook_arg = arg;
+    for (i = 0; i < table->count; i++)
+        channel_set_hook(table->channels[i]);
+    pthread_mutex_unlock(&table->lock);
+}
+
+void channel_table_destroy(struct channel_table *table) {
+    int i;
+
+    for (i = 0; i < table->count; i++) {
+        store_destroy(&table->channels[i]->store);
+        free(table->channels[i]);
+    }
+    table->count = 0;
+    pthread_mutex_destroy(&table->lock);
+}
+
+struct data_store *channel_default(struct channel_table *table) {
+    return &table->channels[0]->store;
+}
+
+struct data_store *channel_select(struct channel_table *table, const char *name, size_t len) {
+    struct channel *channel = NULL;
+    int i;
+
+    if (!valid_name(name, len)) {
+        AESD_LOG(LOG_WARNING, LOG_TYPE_CLIENT_IO, "Invalid channel name %.*s", (int)len, name);
+        return NULL;
+    }
+    if (!table->create && !valid_minor(name, len)) {
+        AESD_LOG(LOG_WARNING, LOG_TYPE_CLIENT_IO, "Channel %.*s doesn't exist as a minor of the driver",
+                 (int)len, name);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&table->lock);
+    for (i = 1; i < table->count; i++) {
+        if (strlen(table->channels[i]->name) == len && memcmp(table->channels[i]->name, name, len) == 0) {
+            channel = table->channels[i];
+            break;
+        }
+    }
+
+    if (!channel) {
+        if (table->count == CHANNEL_MAX) {
+            AESD_LOG(LOG_WARNING, LOG_TYPE_SERVER, "At most %d channels are supported", CHANNEL_MAX);
+        } else if ((channel = channel_open(table, name, len))) {
+            table->channels[table->count++] = channel;
+            AESD_LOG(LOG_INFO, LOG_TYPE_DATA, "Opened channel %s at %s", channel->name, channel->store.path);
+        }
+    }
+    pthread_mutex_unlock(&table->lock);
+
+    return channel ? &channel->store : NULL;
+}
+
+void channel_table_stats(struct channel_table *table, unsigned long *packets, unsigned long *bytes) {
+    int i;
+
+    *packets = 0;
+    *bytes = 0;
+    pthread_mutex_lock(&table->lock);
+    for (i = 0; i < table->count; i++) {
+        *packets += atomic_load(&table->channels[i]->store.packets);
+        *bytes += atomic_load(&table->channels[i]->store.bytes);
+    }
+    pthread_mutex_unlock(&table->lock);
+}
@@ -0,0 +1,91 @@
+/*
+ * channel.h
+ *
+ * Named channels of aesdsocket. Every channel is an independent history with
+ * its own data_store, so its own commit thread, lock and backing file: the
+ * default channel is kept at the base path, a channel called NAME at the base
+ * path followed by the separator and NAME. Channels are created the first
+ * time a client selects them and live until the table is destroyed.
+ */
+
+#ifndef CHANNEL_H
+#define CHANNEL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <limits.h>
+#include <pthread.h>
+
+#include "store.h"
+
+#define CHANNEL_MAX 64
+#define CHANNEL_NAME_MAX 32
+
+/**
+ * Called with every batch committed to a channel, @param channel is "" for the
+ * default one. Same rules as store_commit_hook.
+ */
+typedef void (*channel_commit_hook)(void *arg, const char *channel, const struct iovec *iov, int count);
+
+struct channel_table;
+
+struct channel {
+    char name[CHANNEL_NAME_MAX + 1];
+    struct channel_table *table;
+    struct data_store store;
+};
+
+struct channel_table {
+    char base_path[PATH_MAX];
+    char separator[8];
+    /**
+     * Whether selecting a channel may create its backing file, false when the
+     * channels are existing device nodes
+     */
+    bool create;
+    /**
+     * Entry 0 is the default channel, protected by lock
+     */
+    struct channel *channels[CHANNEL_MAX];
+    int count;
+    pthread_mutex_t lock;
+    channel_commit_hook commit_hook;
+    void *commit_hook_arg;
+};
+
+/**
+ * Set up @param table with its default channel kept at @param base_path.
+ * @return 0 on success, -1 on error.
+ */
+int channel_table_init(struct channel_table *table, const char *base_path, const char *separator, bool create);
+
+/**
+ * Have @param hook called with every batch committed to any channel, existing
+ * or created later. Must be set before the first commit.
+ */
+void channel_table_set_commit_hook(struct channel_table *table, channel_commit_hook hook, void *arg);
+
+/**
+ * Stop the store of every channel and free them.
+ */
+void channel_table_destroy(struct channel_table *table);
+
+/**
+ * @return the store of the default channel.
+ */
+struct data_store *channel_default(struct channel_table *table);
+
+/**
+ * Look up the channel named by the @param len bytes at @param name, creating it
+ * if needed. Names are made of letters, digits, '-' and '_', or are the number
+ * of a minor of the driver, from 1, when channels are existing device nodes.
+ * @return its store, or NULL if the name is invalid or the channel can't be opened.
+ */
+struct data_store *channel_select(struct channel_table *table, const char *name, size_t len);
+
+/**
+ * Add up the packets and bytes committed to every channel.
+ */
+void channel_table_stats(struct channel_table *table, unsigned long *packets, unsigned long *bytes);
+
+#endif /* CHANNEL_H */
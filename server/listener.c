@@ -0,0 +1,455 @@
+/**
+ * @file listener.c
+ * @brief Parsing and setup of the sockets aesdsocket listens on
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <syslog.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "listener.h"
+
+// Older C libraries lack the busy polling options
+#ifndef SO_BUSY_POLL
+#define SO_BUSY_POLL 46
+#endif
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL 69
+#endif
+
+static int parse_int(const char *value, long min, long max, const char *what, const char *spec) {
+    char *end;
+    long result;
+
+    errno = 0;
+    result = strtol(value, &end, 10);
+    if (errno || end == value || *end != '\0' || result < min || result > max) {
+        fprintf(stderr, "Invalid %s '%s' in listener '%s'\n", what, value, spec);
+        return -1;
+    }
+    return (int)result;
+}
+
+static int parse_option(char *option, struct listener_config *config, const char *spec) {
+    char *value = strchr(option, '=');
+    int result;
+
+    if (value)
+        *value++ = '\0';
+
+    if (strcmp(option, "nodelay") == 0 && !value) {
+        config->nodelay = true;
+        return 0;
+    }
+    if (strcmp(option, "v6only") == 0 && !value) {
+        config->v6only = true;
+        return 0;
+    }
+    if (!value) {
+        fprintf(stderr, "Unknown option '%s' in listener '%s'\n", option, spec);
+        return -1;
+    }
+
+    if (strcmp(option, "backlog") == 0) {
+        result = parse_int(value, 1, INT_MAX, option, spec);
+        config->backlog = result;
+    } else if (strcmp(option, "rcvbuf") == 0) {
+        result = parse_int(value, 0, INT_MAX, option, spec);
+        config->rcvbuf = result;
+    } else if (strcmp(option, "sndbuf") == 0) {
+        result = parse_int(value, 0, INT_MAX, option, spec);
+        config->sndbuf = result;
+    } else if (strcmp(option, "defer_accept") == 0) {
+        result = parse_int(value, 0, INT_MAX, option, spec);
+        config->defer_accept = result;
+    } else if (strcmp(option, "busy_poll") == 0) {
+        result = parse_int(value, 0, INT_MAX, option, spec);
+        config->busy_poll = result;
+    } else {
+        fprintf(stderr, "Unknown option '%s' in listener '%s'\n", option, spec);
+        return -1;
+    }
+
+    return result < 0 ? -1 : 0;
+}
+
+static int parse_unix_path(const char *path, struct listener_config *config, const char *spec) {
+    size_t path_len = strlen(path), prefix_len = 0;
+
+    config->family = AF_UNIX;
+
+    // Made absolute now, the daemon changes directory before unlinking it at exit
+    if (path[0] != '/' && path[0] != '@') {
+        if (!getcwd(config->address, sizeof(config->address))) {
+            fprintf(stderr, "Cannot resolve path of listener '%s': %s\n", spec, strerror(errno));
+            return -1;
+        }
+        prefix_len = strlen(config->address) + 1;
+    }
+
+    if (path_len <= (path[0] == '@' ? 1 : 0) ||
+        prefix_len + path_len >= sizeof(((struct sockaddr_un *)NULL)->sun_path)) {
+        fprintf(stderr, "Invalid local socket path in listener '%s'\n", spec);
+        return -1;
+    }
+    if (prefix_len)
+        config->address[prefix_len - 1] = '/';
+    memcpy(config->address + prefix_len, path, path_len + 1);
+    return 0;
+}
+
+static int parse_ip_address(char *address, struct listener_config *config, const char *spec) {
+    char *port = NULL;
+    unsigned char scratch[sizeof(struct in6_addr)];
+    int result;
+
+    if (address[0] == '[') {
+        char *close = strchr(address, ']');
+        if (!close || (close[1] != '\0' && close[1] != ':')) {
+            fprintf(stderr, "Invalid IPv6 address in listener '%s'\n", spec);
+            return -1;
+        }
+        *close = '\0';
+        if (close[1] == ':')
+            port = close + 2;
+        address++;
+        config->family = AF_INET6;
+    } else {
+        port = strchr(address, ':');
+        if (port)
+            *port++ = '\0';
+        config->family = AF_INET;
+    }
+
+    if (strcmp(address, "*") == 0) {
+        // Dual stack wildcard, IPv4 clients show up as v4 mapped addresses
+        config->family = AF_INET6;
+        address = "::";
+    }
+
+    if (inet_pton(config->family, address, scratch) != 1) {
+        fprintf(stderr, "Invalid address '%s' in listener '%s'\n", address, spec);
+        return -1;
+    }
+    if (strlen(address) >= sizeof(config->address)) {
+        fprintf(stderr, "Invalid address '%s' in listener '%s'\n", address, spec);
+        return -1;
+    }
+    memcpy(config->address, address, strlen(address) + 1);
+
+    if (port) {
+        if ((result = parse_int(port, 1, 65535, "port", spec)) < 0)
+            return -1;
+        config->port = result;
+    }
+    return 0;
+}
+
+int listener_parse(const char *spec, struct listener_config *config) {
+    char buf[PATH_MAX + 256];
+    char *options, *option, *saveptr;
+    int rc;
+
+    if (strlen(spec) >= sizeof(buf)) {
+        fprintf(stderr, "Listener '%s' is too long\n", spec);
+        return -1;
+    }
+    strcpy(buf, spec);
+
+    memset(config, 0, sizeof(struct listener_config));
+    config->port = LISTENER_DEFAULT_PORT;
+    config->backlog = LISTENER_DEFAULT_BACKLOG;
+
+    options = strchr(buf, ',');
+    if (options)
+        *options++ = '\0';
+
+    if (strncmp(buf, "unix:", 5) == 0)
+        rc = parse_unix_path(buf + 5, config, spec);
+    else
+        rc = parse_ip_address(buf, config, spec);
+    if (rc == -1)
+        return -1;
+
+    for (option = options ? strtok_r(options, ",", &saveptr) : NULL; option;
+         option = strtok_r(NULL, ",", &saveptr)) {
+        if (parse_option(option, config, spec) == -1)
+            return -1;
+    }
+
+    return 0;
+}
+
+int listener_parse_file(const char *path, struct listener_config *configs, int *count) {
+    FILE *file = fopen(path, "r");
+    char *line = NULL;
+    size_t line_cap = 0;
+    ssize_t line_len;
+    int line_no = 0, rc = 0;
+
+    if (!file) {
+        fprintf(stderr, "Cannot open listener file %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    while ((line_len = getline(&line, &line_cap, file)) != -1) {
+        char *start = line;
+
+        line_no++;
+        while (line_len > 0 && strchr(" \t\r\n", line[line_len - 1]))
+            line[--line_len] = '\0';
+        while (*start == ' ' || *start == '\t')
+            start++;
+        if (*start == '\0' || *start == '#')
+            continue;
+
+        if (*count >= LISTENER_MAX) {
+            fprintf(stderr, "%s:%d: too many listeners, at most %d are supported\n",
+                    path, line_no, LISTENER_MAX);
+            rc = -1;
+            break;
+        }
+        if (listener_parse(start, &configs[*count]) == -1) {
+            fprintf(stderr, "%s:%d: invalid listener\n", path, line_no);
+            rc = -1;
+            break;
+        }
+        (*count)++;
+    }
+
+    free(line);
+    fclose(file);
+    return rc;
+}
+
+static socklen_t unix_address(const struct listener_config *config, struct sockaddr_un *addr) {
+    size_t path_len = strlen(config->address);
+
+    memset(addr, 0, sizeof(struct sockaddr_un));
+    addr->sun_family = AF_UNIX;
+
+    if (config->address[0] == '@') {
+        // sun_path[0] stays '\0'; the name is not NUL terminated
+        memcpy(addr->sun_path + 1, config->address + 1, path_len - 1);
+        return offsetof(struct sockaddr_un, sun_path) + path_len;
+    }
+    memcpy(addr->sun_path, config->address, path_len);
+    return sizeof(struct sockaddr_un);
+}
+
+/*
+ * The dual stack wildcard falls back to IPv4 when @family is AF_INET, which
+ * listener_open() does on kernels without IPv6.
+ */
+static socklen_t ip_address(const struct listener_config *config, int family, struct sockaddr_storage *addr) {
+    memset(addr, 0, sizeof(struct sockaddr_storage));
+    if (family == AF_INET6) {
+        struct sockaddr_in6 *addr6 = (struct sockaddr_in6 *)addr;
+        addr6->sin6_family = AF_INET6;
+        addr6->sin6_port = htons(config->port);
+        inet_pton(AF_INET6, config->address, &addr6->sin6_addr);
+        return sizeof(struct sockaddr_in6);
+    }
+
+    struct sockaddr_in *addr4 = (struct sockaddr_in *)addr;
+    addr4->sin_family = AF_INET;
+    addr4->sin_port = htons(config->port);
+    if (config->family == AF_INET6)
+        addr4->sin_addr.s_addr = htonl(INADDR_ANY);
+    else
+        inet_pton(AF_INET, config->address, &addr4->sin_addr);
+    return sizeof(struct sockaddr_in);
+}
+
+static int open_unix(const struct listener_config *config) {
+    struct sockaddr_un addr;
+    socklen_t addr_len;
+    struct stat st;
+    int fd;
+
+    addr_len = unix_address(config, &addr);
+    // Replace a stale socket left behind, but never any other kind of file
+    if (config->address[0] != '@' && stat(config->address, &st) == 0 && S_ISSOCK(st.st_mode))
+        unlink(config->address);
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1) {
+        syslog(LOG_ERR, "Error creating local socket: %s", strerror(errno));
+        return -1;
+    }
+
+    if (bind(fd, (struct sockaddr *)&addr, addr_len) == -1) {
+        syslog(LOG_ERR, "Error binding local socket %s: %s", config->address, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    if (listen(fd, config->backlog) == -1) {
+        syslog(LOG_ERR, "Error listening on local socket %s: %s", config->address, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    syslog(LOG_INFO, "Listening on unix:%s", config->address);
+    return fd;
+}
+
+static int set_option(int fd, int level, int name, int value, const char *what) {
+    if (setsockopt(fd, level, name, &value, sizeof(value)) == -1) {
+        syslog(LOG_ERR, "Error setting %s: %s", what, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+int listener_open(const struct listener_config *config) {
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    char host[LISTENER_PEER_LEN];
+    int family = config->family;
+    int fd;
+
+    if (family == AF_UNIX)
+        return open_unix(config);
+
+    fd = socket(family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1 && errno == EAFNOSUPPORT && family == AF_INET6 && strcmp(config->address, "::") == 0) {
+        // No IPv6 in this kernel, the wildcard still serves IPv4 clients
+        family = AF_INET;
+        fd = socket(family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    }
+    if (fd == -1) {
+        syslog(LOG_ERR, "Error creating socket: %s", strerror(errno));
+        return -1;
+    }
+
+    addr_len = ip_address(config, family, &addr);
+    listener_format_peer(&addr, host, sizeof(host));
+
+    // Buffer sizes must be set before listen() for the window scale to take them into account
+    if (set_option(fd, SOL_SOCKET, SO_REUSEADDR, 1, "SO_REUSEADDR") == -1 ||
+        (family == AF_INET6 && set_option(fd, IPPROTO_IPV6, IPV6_V6ONLY, config->v6only, "IPV6_V6ONLY") == -1) ||
+        (config->rcvbuf && set_option(fd, SOL_SOCKET, SO_RCVBUF, config->rcvbuf, "SO_RCVBUF") == -1) ||
+        (config->sndbuf && set_option(fd, SOL_SOCKET, SO_SNDBUF, config->sndbuf, "SO_SNDBUF") == -1) ||
+        (config->nodelay && set_option(fd, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY") == -1) ||
+        (config->defer_accept &&
+         set_option(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, config->defer_accept, "TCP_DEFER_ACCEPT") == -1) ||
+        (config->busy_poll && set_option(fd, SOL_SOCKET, SO_BUSY_POLL, config->busy_poll, "SO_BUSY_POLL") == -1)) {
+        close(fd);
+        return -1;
+    }
+    // Only since Linux 5.11, busy polling still works without it
+    if (config->busy_poll && set_option(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, 1, "SO_PREFER_BUSY_POLL") == -1)
+        syslog(LOG_WARNING, "Busy polling on %s port %u without preferring it", host, config->port);
+
+    if (bind(fd, (struct sockaddr *)&addr, addr_len) == -1) {
+        syslog(LOG_ERR, "Error binding socket %s port %u: %s", host, config->port, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    if (listen(fd, config->backlog) == -1) {
+        syslog(LOG_ERR, "Error listening on socket %s port %u: %s", host, config->port, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    syslog(LOG_INFO, "Listening on %s port %u", host, config->port);
+    return fd;
+}
+
+int listener_connect(const struct listener_config *config, int timeout_ms) {
+    struct timeval timeout = {
+        .tv_sec = timeout_ms / 1000,
+        .tv_usec = (timeout_ms % 1000) * 1000,
+    };
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    int fd;
+
+    fd = socket(config->family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+        return -1;
+
+    // The send timeout also bounds connect()
+    if (setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) == -1 ||
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    if (config->family == AF_UNIX) {
+        addr_len = unix_address(config, (struct sockaddr_un *)&addr);
+    } else {
+        addr_len = ip_address(config, config->family, &addr);
+        if ((config->rcvbuf && set_option(fd, SOL_SOCKET, SO_RCVBUF, config->rcvbuf, "SO_RCVBUF") == -1) ||
+            (config->sndbuf && set_option(fd, SOL_SOCKET, SO_SNDBUF, config->sndbuf, "SO_SNDBUF") == -1) ||
+            (config->nodelay && set_option(fd, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY") == -1)) {
+            close(fd);
+            return -1;
+        }
+    }
+
+    if (connect(fd, (struct sockaddr *)&addr, addr_len) == -1) {
+        int saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+        return -1;
+    }
+    return fd;
+}
+
+void listener_close(struct listener *listener) {
+    if (listener->fd == -1)
+        return;
+
+    close(listener->fd);
+    listener->fd = -1;
+    if (listener->config.family == AF_UNIX && listener->config.address[0] != '@')
+        unlink(listener->config.address);
+}
+
+void listener_setup_client(const struct listener_config *config, int fd) {
+    int one = 1;
+
+    if (config->family != AF_UNIX && config->nodelay)
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    // Checked on the listener already, where a missing permission is reported
+    if (config->family != AF_UNIX && config->busy_poll) {
+        setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &config->busy_poll, sizeof(config->busy_poll));
+        setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &one, sizeof(one));
+    }
+}
+
+void listener_format_peer(const struct sockaddr_storage *addr, char *buf, size_t len) {
+    const struct sockaddr_in6 *addr6 = (const struct sockaddr_in6 *)addr;
+
+    switch (addr->ss_family) {
+    case AF_INET:
+        inet_ntop(AF_INET, &((const struct sockaddr_in *)addr)->sin_addr, buf, len);
+        break;
+    case AF_INET6:
+        // IPv4 clients of a dual stack listener are logged the way an IPv4 listener would
+        if (IN6_IS_ADDR_V4MAPPED(&addr6->sin6_addr))
+            inet_ntop(AF_INET, &addr6->sin6_addr.s6_addr[12], buf, len);
+        else
+            inet_ntop(AF_INET6, &addr6->sin6_addr, buf, len);
+        break;
+    case AF_UNIX:
+        snprintf(buf, len, "local socket");
+        break;
+    default:
+        snprintf(buf, len, "unknown");
+        break;
+    }
+}
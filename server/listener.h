@@ -0,0 +1,107 @@
+/*
+ * listener.h
+ *
+ * Listening socket configuration for aesdsocket. A listener is described by
+ * a one line spec, given with -l on the command line or one per line in the
+ * file passed with -c:
+ *
+ *   ADDRESS[:PORT][,OPTION...]
+ *
+ * ADDRESS is an IPv4 address, an IPv6 address in brackets, '*' for the dual
+ * stack wildcard, or unix:PATH / unix:@NAME for a local (abstract) socket.
+ * OPTION is one of backlog=N, rcvbuf=BYTES, sndbuf=BYTES, nodelay,
+ * defer_accept=SECONDS, busy_poll=USECS or v6only.
+ */
+
+#ifndef LISTENER_H
+#define LISTENER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <limits.h>
+#include <netinet/in.h>
+
+#define LISTENER_MAX 16
+#define LISTENER_DEFAULT_PORT 9000
+#define LISTENER_DEFAULT_BACKLOG 10
+#define LISTENER_PEER_LEN INET6_ADDRSTRLEN
+
+struct listener_config {
+    /**
+     * AF_INET, AF_INET6 or AF_UNIX
+     */
+    int family;
+    /**
+     * Numeric address for IP listeners, absolute path or @name for AF_UNIX
+     */
+    char address[PATH_MAX];
+    uint16_t port;
+    int backlog;
+    /**
+     * Socket buffer sizes in bytes, 0 keeps the system default
+     */
+    int rcvbuf;
+    int sndbuf;
+    bool nodelay;
+    /**
+     * TCP_DEFER_ACCEPT timeout in seconds, 0 to disable
+     */
+    int defer_accept;
+    /**
+     * SO_BUSY_POLL time in microseconds for the connections, also preferring
+     * busy polling over interrupts where the kernel supports it; 0 to disable.
+     * Above net.core.busy_read it needs CAP_NET_ADMIN.
+     */
+    int busy_poll;
+    bool v6only;
+};
+
+struct listener {
+    struct listener_config config;
+    int fd;
+};
+
+/**
+ * Fill @param config from the listener @param spec described above.
+ * @return 0 on success, -1 if the spec is invalid (reported on stderr).
+ */
+int listener_parse(const char *spec, struct listener_config *config);
+
+/**
+ * Append one listener per non empty, non comment line of @param path to @param configs,
+ * which holds @param *count entries out of LISTENER_MAX.
+ * @return 0 on success, -1 on error.
+ */
+int listener_parse_file(const char *path, struct listener_config *configs, int *count);
+
+/**
+ * Create, configure, bind and listen on a non blocking socket for @param config.
+ * @return the socket, or -1 with the failure logged to syslog.
+ */
+int listener_open(const struct listener_config *config);
+
+/**
+ * Open a blocking connection to the address of @param config, applying its
+ * buffer size and nodelay options. The wildcard connects to the local host.
+ * Connecting, sending and receiving give up after @param timeout_ms.
+ * @return the socket, or -1 with errno set.
+ */
+int listener_connect(const struct listener_config *config, int timeout_ms);
+
+/**
+ * Close @param listener and remove its socket file if it has one.
+ */
+void listener_close(struct listener *listener);
+
+/**
+ * Apply the per connection options of @param config to an accepted @param fd.
+ */
+void listener_setup_client(const struct listener_config *config, int fd);
+
+/**
+ * Format the address of @param addr, or "local socket", into @param buf which should
+ * hold LISTENER_PEER_LEN bytes. Reentrant, unlike inet_ntoa.
+ */
+void listener_format_peer(const struct sockaddr_storage *addr, char *buf, size_t len);
+
+#endif /* LISTENER_H */
@@ -0,0 +1,502 @@
+/**
+ * @file replication.c
+ * @brief Shipping committed packets from a primary aesdsocket to a follower
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <endian.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+
+#include "async-log.h"
+#include "replication.h"
+
+static int send_all(int fd, struct iovec *iov, int count) {
+    struct msghdr msg = {
+        .msg_iov = iov,
+        .msg_iovlen = count,
+    };
+    ssize_t rc;
+
+    while (msg.msg_iovlen > 0) {
+        rc = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (rc == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        while (msg.msg_iovlen > 0 && (size_t)rc >= msg.msg_iov->iov_len) {
+            rc -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen > 0) {
+            msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base + rc;
+            msg.msg_iov->iov_len -= rc;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Receive exactly @len bytes, giving up after @timeout_ms without data (-1
+ * waits forever) or as soon as @stop_fd (ignored when -1) becomes readable.
+ */
+static int recv_all(int fd, int stop_fd, void *buf, size_t len, int timeout_ms) {
+    struct pollfd fds[2] = {
+        { .fd = fd, .events = POLLIN },
+        { .fd = stop_fd, .events = POLLIN },
+    };
+    ssize_t rc;
+
+    while (len > 0) {
+        rc = poll(fds, 2, timeout_ms);
+        if (rc == -1 && errno == EINTR)
+            continue;
+        if (rc <= 0 || fds[1].revents)
+            return -1;
+
+        rc = recv(fd, buf, len, 0);
+        if (rc == -1 && errno == EINTR)
+            continue;
+        if (rc <= 0)
+            return -1;
+        buf = (char *)buf + rc;
+        len -= rc;
+    }
+    return 0;
+}
+
+static int send_ack(int fd, uint64_t seq) {
+    struct repl_ack ack = {
+        .magic = htobe32(REPL_ACK),
+        .seq = htobe64(seq),
+    };
+    struct iovec iov = { .iov_base = &ack, .iov_len = sizeof(ack) };
+
+    return send_all(fd, &iov, 1);
+}
+
+/*
+ * Free every frame up to and including @seq, called with the lock held
+ */
+static void release_acked(struct replication *repl, uint64_t seq) {
+    struct repl_frame *frame;
+
+    while ((frame = repl->head) && frame->seq <= seq) {
+        repl->head = frame->next;
+        if (frame == repl->unsent)
+            repl->unsent = frame->next;
+        else
+            repl->in_flight--;
+        repl->backlog -= frame->length;
+        free(frame);
+    }
+    if (!repl->head)
+        repl->tail = NULL;
+}
+
+void replication_ship(void *arg, const char *channel, const struct iovec *iov, int count) {
+    struct replication *repl = arg;
+    size_t channel_length = strlen(channel);
+    size_t length = 0;
+    struct repl_frame *frame;
+    char *pos;
+    int i;
+
+    for (i = 0; i < count; i++)
+        length += iov[i].iov_len;
+
+    frame = length <= REPLICATION_FRAME_MAX ? malloc(sizeof(struct repl_frame) + channel_length + length) : NULL;
+    if (frame) {
+        frame->next = NULL;
+        frame->channel_length = channel_length;
+        frame->length = length;
+        memcpy(frame->data, channel, channel_length);
+        pos = frame->data + channel_length;
+        for (i = 0; i < count; i++) {
+            memcpy(pos, iov[i].iov_base, iov[i].iov_len);
+            pos += iov[i].iov_len;
+        }
+    }
+
+    pthread_mutex_lock(&repl->lock);
+    // Dropped batches still use up their seq, so the follower sees the gap
+    if (!frame || (repl->backlog > 0 && repl->backlog + length > REPLICATION_BACKLOG_MAX)) {
+        repl->next_seq++;
+        repl->dropped++;
+        if (!repl->overflowing)
+            AESD_LOG(LOG_WARNING, LOG_TYPE_DATA, "Replication backlog full, the follower will miss packets");
+        repl->overflowing = true;
+        pthread_mutex_unlock(&repl->lock);
+        free(frame);
+        return;
+    }
+
+    if (repl->overflowing)
+        AESD_LOG(LOG_WARNING, LOG_TYPE_DATA, "Replication resumed, %llu batches were dropped",
+                 (unsigned long long)repl->dropped);
+    repl->overflowing = false;
+
+    frame->seq = repl->next_seq++;
+    if (repl->tail)
+        repl->tail->next = frame;
+    else
+        repl->head = frame;
+    repl->tail = frame;
+    if (!repl->unsent)
+        repl->unsent = frame;
+    repl->backlog += length;
+    pthread_mutex_unlock(&repl->lock);
+
+    eventfd_write(repl->wake_fd, 1);
+}
+
+static int connect_follower(struct replication *repl, bool *reported) {
+    struct repl_hello hello = {
+        .magic = htobe32(REPL_HELLO),
+        .epoch = htobe64(repl->epoch),
+    };
+    struct iovec iov = { .iov_base = &hello, .iov_len = sizeof(hello) };
+    struct repl_ack ack;
+    uint64_t acked;
+    int fd;
+
+    fd = listener_connect(&repl->follower, REPLICATION_IO_TIMEOUT_MS);
+    if (fd == -1) {
+        // Only once per outage, the shipper retries every REPLICATION_RETRY_MS
+        if (!*reported)
+            AESD_LOG(LOG_WARNING, LOG_TYPE_CONNECTION, "Error connecting to follower %s port %u: %s",
+                     repl->follower.address, repl->follower.port, strerror(errno));
+        *reported = true;
+        return -1;
+    }
+
+    if (send_all(fd, &iov, 1) == -1 ||
+        recv_all(fd, -1, &ack, sizeof(ack), REPLICATION_IO_TIMEOUT_MS) == -1 ||
+        be32toh(ack.magic) != REPL_ACK) {
+        AESD_LOG(LOG_ERR, LOG_TYPE_CONNECTION, "Follower %s port %u did not answer the replication hello",
+                 repl->follower.address, repl->follower.port);
+        *reported = true;
+        close(fd);
+        return -1;
+    }
+    acked = be64toh(ack.seq);
+
+    // Everything the follower doesn't have yet goes out again
+    pthread_mutex_lock(&repl->lock);
+    repl->unsent = repl->head;
+    repl->in_flight = 0;
+    release_acked(repl, acked);
+    repl->fd = fd;
+    pthread_mutex_unlock(&repl->lock);
+
+    AESD_LOG(LOG_INFO, LOG_TYPE_CONNECTION, "Replicating to follower %s port %u after frame %llu",
+             repl->follower.address, repl->follower.port, (unsigned long long)acked);
+    *reported = false;
+    return fd;
+}
+
+static void disconnect_follower(struct replication *repl, int fd) {
+    pthread_mutex_lock(&repl->lock);
+    repl->fd = -1;
+    pthread_mutex_unlock(&repl->lock);
+    close(fd);
+
+    AESD_LOG(LOG_WARNING, LOG_TYPE_CONNECTION, "Lost connection to follower %s port %u",
+             repl->follower.address, repl->follower.port);
+}
+
+static int send_frames(struct replication *repl, int fd) {
+    struct repl_frame_header header;
+    struct repl_frame *frame;
+    struct iovec iov[2];
+
+    for (;;) {
+        // Only this thread frees frames, so they stay valid once unlocked
+        pthread_mutex_lock(&repl->lock);
+        frame = repl->in_flight < REPLICATION_WINDOW ? repl->unsent : NULL;
+        if (frame) {
+            repl->unsent = frame->next;
+            repl->in_flight++;
+        }
+        pthread_mutex_unlock(&repl->lock);
+        if (!frame)
+            return 0;
+
+        memset(&header, 0, sizeof(header));
+        header.magic = htobe32(REPL_FRAME);
+        header.length = htobe32(frame->length);
+        header.seq = htobe64(frame->seq);
+        header.channel_length = htobe16(frame->channel_length);
+        iov[0].iov_base = &header;
+        iov[0].iov_len = sizeof(header);
+        iov[1].iov_base = frame->data;
+        iov[1].iov_len = frame->channel_length + frame->length;
+        if (send_all(fd, iov, 2) == -1)
+            return -1;
+    }
+}
+
+static void *shipper_thread(void *arg) {
+    struct replication *repl = arg;
+    struct repl_ack ack;
+    size_t ack_fill = 0;
+    bool stopping, empty, reported = false;
+    eventfd_t wakeups;
+    int fd = -1;
+
+    for (;;) {
+        struct pollfd fds[2] = {
+            { .fd = fd, .events = POLLIN },
+            { .fd = repl->wake_fd, .events = POLLIN },
+        };
+        ssize_t rc;
+
+        pthread_mutex_lock(&repl->lock);
+        stopping = repl->stopping;
+        empty = !repl->head;
+        pthread_mutex_unlock(&repl->lock);
+        // Keep going while stopping only as long as there is something to deliver
+        if (stopping && (empty || fd == -1))
+            break;
+
+        if (fd == -1) {
+            fd = connect_follower(repl, &reported);
+            if (fd == -1) {
+                fds[0].fd = -1;
+                if (poll(&fds[1], 1, REPLICATION_RETRY_MS) > 0)
+                    eventfd_read(repl->wake_fd, &wakeups);
+                continue;
+            }
+            fds[0].fd = fd;
+            ack_fill = 0;
+        }
+
+        if (send_frames(repl, fd) == -1) {
+            disconnect_follower(repl, fd);
+            fd = -1;
+            continue;
+        }
+
+        if (poll(fds, 2, -1) == -1) {
+            if (errno == EINTR)
+                continue;
+            AESD_LOG(LOG_ERR, LOG_TYPE_SERVER, "Error polling follower: %s", strerror(errno));
+            break;
+        }
+        if (fds[1].revents)
+            eventfd_read(repl->wake_fd, &wakeups);
+        if (!fds[0].revents)
+            continue;
+
+        rc = recv(fd, (char *)&ack + ack_fill, sizeof(ack) - ack_fill, MSG_DONTWAIT);
+        if (rc == -1 && (errno == EINTR || errno == EAGAIN))
+            continue;
+        if (rc <= 0 || (ack_fill + rc == sizeof(ack) && be32toh(ack.magic) != REPL_ACK)) {
+            disconnect_follower(repl, fd);
+            fd = -1;
+            continue;
+        }
+        ack_fill += rc;
+        if (ack_fill == sizeof(ack)) {
+            pthread_mutex_lock(&repl->lock);
+            release_acked(repl, be64toh(ack.seq));
+            pthread_mutex_unlock(&repl->lock);
+            ack_fill = 0;
+        }
+    }
+
+    if (fd != -1) {
+        pthread_mutex_lock(&repl->lock);
+        repl->fd = -1;
+        pthread_mutex_unlock(&repl->lock);
+        close(fd);
+    }
+    return NULL;
+}
+
+int replication_start(struct replication *repl, const struct listener_config *follower) {
+    struct timespec now;
+
+    memset(repl, 0, sizeof(struct replication));
+    repl->follower = *follower;
+    repl->next_seq = 1;
+    repl->fd = -1;
+
+    // Tells the follower a restarted primary apart, whose seq starts over
+    clock_gettime(CLOCK_REALTIME, &now);
+    repl->epoch = (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+
+    repl->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (repl->wake_fd == -1)
+        return -1;
+    pthread_mutex_init(&repl->lock, NULL);
+
+    if (pthread_create(&repl->thread, NULL, shipper_thread, repl) != 0) {
+        pthread_mutex_destroy(&repl->lock);
+        close(repl->wake_fd);
+        return -1;
+    }
+    return 0;
+}
+
+void replication_stop(struct replication *repl) {
+    struct repl_frame *frame;
+    struct timespec deadline;
+    size_t pending = 0;
+
+    pthread_mutex_lock(&repl->lock);
+    repl->stopping = true;
+    pthread_mutex_unlock(&repl->lock);
+    eventfd_write(repl->wake_fd, 1);
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += REPLICATION_DRAIN_MS / 1000;
+    deadline.tv_nsec += (REPLICATION_DRAIN_MS % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    if (pthread_timedjoin_np(repl->thread, NULL, &deadline) != 0) {
+        // Wakes a shipper stuck waiting on the follower
+        pthread_mutex_lock(&repl->lock);
+        if (repl->fd != -1)
+            shutdown(repl->fd, SHUT_RDWR);
+        pthread_mutex_unlock(&repl->lock);
+        pthread_join(repl->thread, NULL);
+    }
+
+    while ((frame = repl->head)) {
+        repl->head = frame->next;
+        free(frame);
+        pending++;
+    }
+    if (pending > 0)
+        AESD_LOG(LOG_WARNING, LOG_TYPE_DATA, "%zu batches were never acknowledged by the follower", pending);
+
+    pthread_mutex_destroy(&repl->lock);
+    close(repl->wake_fd);
+}
+
+void replica_init(struct replica *replica, struct channel_table *channels) {
+    memset(replica, 0, sizeof(struct replica));
+    replica->channels = channels;
+    pthread_mutex_init(&replica->lock, NULL);
+}
+
+void replica_destroy(struct replica *replica) {
+    pthread_mutex_destroy(&replica->lock);
+}
+
+/*
+ * Commit one frame, unless a previous connection of the same primary already
+ * did. Holding the lock keeps streams of the same epoch from racing.
+ * @return the highest seq committed, 0 if the frame can't be committed
+ */
+static uint64_t apply_frame(struct replica *replica, uint64_t epoch, uint64_t seq, const char *channel,
+                            size_t channel_length, const char *payload, size_t length, const char *peer) {
+    struct data_store *store;
+    uint64_t applied = 0;
+
+    pthread_mutex_lock(&replica->lock);
+    if (replica->epoch != epoch) {
+        AESD_LOG(LOG_WARNING, LOG_TYPE_DATA, "Replication stream from %s was superseded", peer);
+        goto out;
+    }
+
+    if (seq <= replica->applied) {
+        applied = replica->applied;
+        goto out;
+    }
+    if (replica->applied > 0 && seq != replica->applied + 1)
+        AESD_LOG(LOG_WARNING, LOG_TYPE_DATA, "Primary %s dropped frames %llu to %llu", peer,
+                 (unsigned long long)replica->applied + 1, (unsigned long long)seq - 1);
+
+    store = channel_length ? channel_select(replica->channels, channel, channel_length)
+                           : channel_default(replica->channels);
+    if (!store || store_commit(store, payload, length) == -1)
+        goto out;
+    replica->applied = applied = seq;
+
+out:
+    pthread_mutex_unlock(&replica->lock);
+    return applied;
+}
+
+int replica_serve(struct replica *replica, int fd, int stop_fd, const char *peer) {
+    struct repl_hello hello;
+    struct repl_frame_header header;
+    char *buffer = NULL;
+    size_t buffer_size = 0;
+    uint64_t epoch, applied;
+    int rc = -1;
+
+    if (recv_all(fd, stop_fd, &hello, sizeof(hello), REPLICATION_IO_TIMEOUT_MS) == -1 ||
+        be32toh(hello.magic) != REPL_HELLO) {
+        AESD_LOG(LOG_ERR, LOG_TYPE_CONNECTION, "Invalid replication hello from %s", peer);
+        return -1;
+    }
+    epoch = be64toh(hello.epoch);
+
+    pthread_mutex_lock(&replica->lock);
+    if (replica->epoch != epoch) {
+        replica->epoch = epoch;
+        replica->applied = 0;
+    }
+    applied = replica->applied;
+    pthread_mutex_unlock(&replica->lock);
+
+    if (send_ack(fd, applied) == -1)
+        return -1;
+
+    for (;;) {
+        size_t channel_length, length;
+
+        if (recv_all(fd, stop_fd, &header, 1, -1) == -1) {
+            // A clean close between frames is how the primary ends the stream
+            rc = 0;
+            break;
+        }
+        if (recv_all(fd, stop_fd, (char *)&header + 1, sizeof(header) - 1, REPLICATION_IO_TIMEOUT_MS) == -1)
+            break;
+
+        channel_length = be16toh(header.channel_length);
+        length = be32toh(header.length);
+        if (be32toh(header.magic) != REPL_FRAME || channel_length > CHANNEL_NAME_MAX ||
+            length > REPLICATION_FRAME_MAX) {
+            AESD_LOG(LOG_ERR, LOG_TYPE_CONNECTION, "Invalid replication frame from %s", peer);
+            break;
+        }
+
+        if (channel_length + length > buffer_size) {
+            char *new_buffer = realloc(buffer, channel_length + length);
+            if (!new_buffer) {
+                AESD_LOG(LOG_ERR, LOG_TYPE_SERVER, "Error allocating memory for frame: %s", strerror(errno));
+                break;
+            }
+            buffer = new_buffer;
+            buffer_size = channel_length + length;
+        }
+        if (recv_all(fd, stop_fd, buffer, channel_length + length, REPLICATION_IO_TIMEOUT_MS) == -1)
+            break;
+
+        applied = apply_frame(replica, epoch, be64toh(header.seq), buffer, channel_length,
+                              buffer + channel_length, length, peer);
+        // Without an ack the primary sends the frame again once it reconnects
+        if (applied == 0 || send_ack(fd, applied) == -1)
+            break;
+    }
+
+    free(buffer);
+    return rc;
+}
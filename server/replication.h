@@ -0,0 +1,153 @@
+/*
+ * replication.h
+ *
+ * Log shipping from a primary aesdsocket to a follower. The primary hands
+ * every batch its channels commit to a shipper thread, which sends it to the
+ * follower as one sequence numbered frame and keeps it until the follower
+ * acknowledges it; frames still unacknowledged when the connection drops are
+ * sent again after reconnecting. The follower commits each frame to the same
+ * channel of its own history, so its clients can read back from it.
+ *
+ * The stream starts with a hello from the primary, answered by an ack. Every
+ * integer is big endian on the wire.
+ *
+ *   primary -> follower  hello: REPL_HELLO, epoch
+ *   primary -> follower  frame: REPL_FRAME, payload length, seq, channel length,
+ *                               then the channel name and the payload
+ *   follower -> primary  ack:   REPL_ACK, highest seq committed in this epoch
+ *
+ * The epoch identifies a primary run; sequence numbers start over at 1 with
+ * every new epoch.
+ */
+
+#ifndef REPLICATION_H
+#define REPLICATION_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+#include "channel.h"
+#include "listener.h"
+
+#define REPL_HELLO 0x41455248 /* "AERH" */
+#define REPL_FRAME 0x41455246 /* "AERF" */
+#define REPL_ACK   0x41455241 /* "AERA" */
+
+/**
+ * Frames sent but not acknowledged yet
+ */
+#define REPLICATION_WINDOW 64
+/**
+ * Bytes of frames kept for the follower, later batches are dropped once full
+ */
+#define REPLICATION_BACKLOG_MAX (64 << 20)
+#define REPLICATION_FRAME_MAX (16 << 20)
+#define REPLICATION_RETRY_MS 1000
+#define REPLICATION_IO_TIMEOUT_MS 5000
+#define REPLICATION_DRAIN_MS 2000
+
+struct repl_hello {
+    uint32_t magic;
+    uint32_t reserved;
+    uint64_t epoch;
+};
+
+struct repl_frame_header {
+    uint32_t magic;
+    uint32_t length;
+    uint64_t seq;
+    uint16_t channel_length;
+    uint16_t reserved[3];
+};
+
+struct repl_ack {
+    uint32_t magic;
+    uint32_t reserved;
+    uint64_t seq;
+};
+
+/**
+ * A committed batch waiting for its acknowledgement
+ */
+struct repl_frame {
+    struct repl_frame *next;
+    uint64_t seq;
+    size_t channel_length;
+    size_t length;
+    char data[];                    // Channel name followed by the payload
+};
+
+struct replication {
+    struct listener_config follower;
+    uint64_t epoch;
+    pthread_t thread;
+    /**
+     * Written when frames are queued and on shutdown, wakes the shipper thread
+     */
+    int wake_fd;
+    pthread_mutex_t lock;
+    /**
+     * Everything below is protected by lock. Frames are in seq order, from the
+     * oldest unacknowledged one to the newest; frames before unsent went out
+     * on the current connection.
+     */
+    struct repl_frame *head;
+    struct repl_frame *tail;
+    struct repl_frame *unsent;
+    int in_flight;
+    size_t backlog;
+    uint64_t next_seq;
+    uint64_t dropped;
+    bool overflowing;
+    bool stopping;
+    /**
+     * Connection to the follower, -1 while disconnected
+     */
+    int fd;
+};
+
+/**
+ * Follower side, shared by every replication stream it accepts
+ */
+struct replica {
+    struct channel_table *channels;
+    pthread_mutex_t lock;
+    uint64_t epoch;
+    /**
+     * Highest seq of epoch committed so far, protected by lock
+     */
+    uint64_t applied;
+};
+
+/**
+ * Start shipping to the follower at @param follower.
+ * @return 0 on success, -1 on error.
+ */
+int replication_start(struct replication *repl, const struct listener_config *follower);
+
+/**
+ * channel_commit_hook queueing a batch for the follower, @param arg is the replication.
+ */
+void replication_ship(void *arg, const char *channel, const struct iovec *iov, int count);
+
+/**
+ * Give the follower up to REPLICATION_DRAIN_MS to acknowledge what is queued,
+ * then stop the shipper thread.
+ */
+void replication_stop(struct replication *repl);
+
+void replica_init(struct replica *replica, struct channel_table *channels);
+
+void replica_destroy(struct replica *replica);
+
+/**
+ * Commit the frames of the replication stream on @param fd until it closes or
+ * @param stop_fd becomes readable.
+ * @return 0 when the stream ended between frames, -1 on error.
+ */
+int replica_serve(struct replica *replica, int fd, int stop_fd, const char *peer);
+
+#endif /* REPLICATION_H */
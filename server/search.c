@@ -0,0 +1,56 @@
+/**
+ * @file search.c
+ * @brief Vectorized substring search over the aesdsocket history
+ */
+
+#define _GNU_SOURCE
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "search.h"
+
+#ifdef __SSE2__
+/*
+ * A position can only match if both the first and the last byte of the needle
+ * line up, which rules out almost every position of text with one compare per
+ * 16 bytes. See http://0x80.pl/articles/simd-strfind.html
+ */
+static const char *find_sse2(const char *haystack, size_t haystack_len, const char *needle, size_t needle_len) {
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[needle_len - 1]);
+    size_t offset;
+
+    for (offset = 0; offset + needle_len - 1 + 16 <= haystack_len; offset += 16) {
+        __m128i block_first = _mm_loadu_si128((const __m128i *)(haystack + offset));
+        __m128i block_last = _mm_loadu_si128((const __m128i *)(haystack + offset + needle_len - 1));
+        unsigned int mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(first, block_first),
+                                                            _mm_cmpeq_epi8(last, block_last)));
+
+        while (mask) {
+            const char *candidate = haystack + offset + __builtin_ctz(mask);
+            if (memcmp(candidate + 1, needle + 1, needle_len - 1) == 0)
+                return candidate;
+            mask &= mask - 1;
+        }
+    }
+
+    // Fewer than 16 positions left
+    return memmem(haystack + offset, haystack_len - offset, needle, needle_len);
+}
+#endif
+
+const char *search_find(const char *haystack, size_t haystack_len, const char *needle, size_t needle_len) {
+    if (needle_len == 0)
+        return haystack;
+    if (needle_len > haystack_len)
+        return NULL;
+
+#ifdef __SSE2__
+    return find_sse2(haystack, haystack_len, needle, needle_len);
+#else
+    return memmem(haystack, haystack_len, needle, needle_len);
+#endif
+}
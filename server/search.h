@@ -0,0 +1,20 @@
+/*
+ * search.h
+ *
+ * Substring search used by the AESD_SEARCH command. On x86 the haystack is
+ * filtered 16 bytes at a time with SSE2, comparing the first and last byte of
+ * the needle at once, and only candidate positions are checked in full.
+ */
+
+#ifndef SEARCH_H
+#define SEARCH_H
+
+#include <stddef.h>
+
+/**
+ * @return the first occurrence of @param needle in @param haystack, or NULL.
+ *   An empty needle matches at the start of the haystack.
+ */
+const char *search_find(const char *haystack, size_t haystack_len, const char *needle, size_t needle_len);
+
+#endif /* SEARCH_H */
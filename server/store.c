@@ -0,0 +1,372 @@
+/**
+ * @file store.c
+ * @brief Group commit of client packets into the aesdsocket history
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "async-log.h"
+#include "search.h"
+#include "store.h"
+
+#define STORE_READ_SIZE 4096
+#define STORE_SEND_IOV 64
+
+struct snapshot {
+    char *data;
+    size_t len;
+    bool mapped;
+};
+
+static int write_batch(struct data_store *store, struct iovec *iov, int count) {
+    ssize_t rc;
+    int result = 0;
+
+    pthread_rwlock_wrlock(&store->file_lock);
+
+    while (count > 0) {
+        rc = writev(store->commit_fd, iov, count);
+        if (rc == -1) {
+            if (errno == EINTR)
+                continue;
+            AESD_LOG(LOG_ERR, LOG_TYPE_DATA, "Error writing to file %s: %s", store->path, strerror(errno));
+            result = -1;
+            break;
+        }
+
+        // Skip what a short write already took care of
+        while (count > 0 && (size_t)rc >= iov->iov_len) {
+            rc -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *)iov->iov_base + rc;
+            iov->iov_len -= rc;
+        }
+    }
+
+    pthread_rwlock_unlock(&store->file_lock);
+    return result;
+}
+
+static void *commit_thread(void *arg) {
+    struct data_store *store = arg;
+    struct iovec batch[STORE_BATCH_MAX];
+    struct iovec iov[STORE_BATCH_MAX];
+    struct aesd_buffer_entry entry;
+    size_t first, index;
+    int count, result;
+
+    for (;;) {
+        pthread_mutex_lock(&store->commit_mutex);
+        // Producers signal under the mutex after publishing, so no wakeup is lost
+        while (!aesd_mpsc_ring_pop(&store->queue, &entry)) {
+            if (store->stopping) {
+                pthread_mutex_unlock(&store->commit_mutex);
+                return NULL;
+            }
+            pthread_cond_wait(&store->work_cond, &store->commit_mutex);
+        }
+        pthread_mutex_unlock(&store->commit_mutex);
+
+        first = aesd_mpsc_ring_tail(&store->queue) - 1;
+        count = 0;
+        do {
+            batch[count].iov_base = (void *)entry.buffptr;
+            batch[count].iov_len = entry.size;
+            count++;
+        } while (count < STORE_BATCH_MAX && aesd_mpsc_ring_pop(&store->queue, &entry));
+
+        // write_batch() advances its iovecs over short writes, keep the batch intact
+        memcpy(iov, batch, count * sizeof(struct iovec));
+        result = write_batch(store, iov, count);
+        if (result == 0 && store->commit_hook)
+            store->commit_hook(store->commit_hook_arg, batch, count);
+
+        pthread_mutex_lock(&store->commit_mutex);
+        for (index = 0; index < (size_t)count; index++) {
+            struct commit_status *status = &store->status[(first + index) & store->queue.mask];
+            status->ticket = first + index;
+            status->result = result;
+            if (result == 0) {
+                atomic_fetch_add_explicit(&store->packets, 1, memory_order_relaxed);
+                atomic_fetch_add_explicit(&store->bytes, batch[index].iov_len, memory_order_relaxed);
+            }
+        }
+        store->last_result = result;
+        store->committed = first + count;
+        pthread_cond_broadcast(&store->done_cond);
+        pthread_mutex_unlock(&store->commit_mutex);
+    }
+}
+
+int store_init(struct data_store *store, const char *path) {
+    pthread_rwlockattr_t attr;
+
+    memset(store, 0, sizeof(struct data_store));
+    snprintf(store->path, sizeof(store->path), "%s", path);
+
+    // Opened now, so a missing device or an unwritable path fails the start of aesdsocket
+    store->commit_fd = open(store->path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+    if (store->commit_fd == -1) {
+        AESD_LOG(LOG_ERR, LOG_TYPE_DATA, "Error opening file %s: %s", store->path, strerror(errno));
+        return -1;
+    }
+
+    if (aesd_mpsc_ring_init(&store->queue, STORE_QUEUE_SIZE) == -1) {
+        close(store->commit_fd);
+        return -1;
+    }
+    store->status = calloc(store->queue.mask + 1, sizeof(struct commit_status));
+    if (!store->status) {
+        aesd_mpsc_ring_destroy(&store->queue);
+        close(store->commit_fd);
+        return -1;
+    }
+
+    pthread_mutex_init(&store->commit_mutex, NULL);
+    pthread_cond_init(&store->work_cond, NULL);
+    pthread_cond_init(&store->done_cond, NULL);
+
+    // Readbacks of the char device copy it under the lock, they must not starve commits
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&store->file_lock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+
+    if (pthread_create(&store->commit_thread, NULL, commit_thread, store) != 0) {
+        pthread_rwlock_destroy(&store->file_lock);
+        pthread_cond_destroy(&store->done_cond);
+        pthread_cond_destroy(&store->work_cond);
+        pthread_mutex_destroy(&store->commit_mutex);
+        free(store->status);
+        aesd_mpsc_ring_destroy(&store->queue);
+        close(store->commit_fd);
+        return -1;
+    }
+
+    return 0;
+}
+
+void store_destroy(struct data_store *store) {
+    pthread_mutex_lock(&store->commit_mutex);
+    store->stopping = true;
+    pthread_cond_signal(&store->work_cond);
+    pthread_mutex_unlock(&store->commit_mutex);
+    pthread_join(store->commit_thread, NULL);
+
+    fdatasync(store->commit_fd);
+    close(store->commit_fd);
+
+    pthread_rwlock_destroy(&store->file_lock);
+    pthread_cond_destroy(&store->done_cond);
+    pthread_cond_destroy(&store->work_cond);
+    pthread_mutex_destroy(&store->commit_mutex);
+    free(store->status);
+    aesd_mpsc_ring_destroy(&store->queue);
+}
+
+int store_commit(struct data_store *store, const char *data, size_t len) {
+    struct aesd_buffer_entry entry = {
+        .buffptr = data,
+        .size = len,
+    };
+    struct commit_status *status;
+    size_t ticket;
+    int result;
+
+    while (!aesd_mpsc_ring_push(&store->queue, &entry, &ticket))
+        sched_yield();  // Queue full, give the commit thread a chance to catch up
+
+    pthread_mutex_lock(&store->commit_mutex);
+    pthread_cond_signal(&store->work_cond);
+    while (store->committed <= ticket)
+        pthread_cond_wait(&store->done_cond, &store->commit_mutex);
+
+    // The slot only gets reused after a full queue of later commits went through
+    status = &store->status[ticket & store->queue.mask];
+    result = status->ticket == ticket ? status->result : store->last_result;
+    pthread_mutex_unlock(&store->commit_mutex);
+
+    return result;
+}
+
+/*
+ * Capture the history as of the last completed commit. Only looking up its
+ * size needs the lock, since commits append and never touch earlier bytes.
+ * Regular files are mapped, the char device can't be and is copied instead.
+ */
+static int take_snapshot(struct data_store *store, struct snapshot *snapshot) {
+    struct stat st;
+    ssize_t bytes_read;
+    size_t cap = 0;
+    char *data;
+    int file_fd, rc;
+
+    memset(snapshot, 0, sizeof(struct snapshot));
+
+    file_fd = open(store->path, O_RDONLY | O_CLOEXEC);
+    if (file_fd == -1) {
+        AESD_LOG(LOG_ERR, LOG_TYPE_DATA, "Error opening file %s: %s", store->path, strerror(errno));
+        return -1;
+    }
+
+    pthread_rwlock_rdlock(&store->file_lock);
+    rc = fstat(file_fd, &st);
+    if (rc == 0 && S_ISREG(st.st_mode)) {
+        pthread_rwlock_unlock(&store->file_lock);
+        if (st.st_size > 0) {
+            data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, file_fd, 0);
+            if (data == MAP_FAILED) {
+                AESD_LOG(LOG_ERR, LOG_TYPE_DATA, "Error mapping file %s: %s", store->path, strerror(errno));
+                close(file_fd);
+                return -1;
+            }
+            snapshot->data = data;
+            snapshot->len = st.st_size;
+            snapshot->mapped = true;
+        }
+        close(file_fd);
+        return 0;
+    }
+
+    for (;;) {
+        if (snapshot->len == cap) {
+            cap = cap ? cap * 2 : STORE_READ_SIZE;
+            data = realloc(snapshot->data, cap);
+            if (!data) {
+                bytes_read = -1;
+                break;
+            }
+            snapshot->data = data;
+        }
+        bytes_read = read(file_fd, snapshot->data + snapshot->len, cap - snapshot->len);
+        if (bytes_read <= 0)
+            break;
+        snapshot->len += bytes_read;
+    }
+    pthread_rwlock_unlock(&store->file_lock);
+    close(file_fd);
+
+    if (bytes_read != 0) {
+        if (bytes_read == -1)
+            AESD_LOG(LOG_ERR, LOG_TYPE_DATA, "Error reading file %s: %s", store->path, strerror(errno));
+        free(snapshot->data);
+        return -1;
+    }
+    return 0;
+}
+
+static void release_snapshot(struct snapshot *snapshot) {
+    if (snapshot->mapped)
+        munmap(snapshot->data, snapshot->len);
+    else
+        free(snapshot->data);
+}
+
+static int send_iov(int client_fd, struct iovec *iov, int count) {
+    struct msghdr msg = {
+        .msg_iov = iov,
+        .msg_iovlen = count,
+    };
+    ssize_t rc;
+
+    while (msg.msg_iovlen > 0) {
+        rc = sendmsg(client_fd, &msg, MSG_NOSIGNAL);
+        if (rc == -1) {
+            if (errno == EINTR)
+                continue;
+            AESD_LOG(LOG_ERR, LOG_TYPE_CLIENT_IO, "Error sending data to client: %s", strerror(errno));
+            return -1;
+        }
+
+        while (msg.msg_iovlen > 0 && (size_t)rc >= msg.msg_iov->iov_len) {
+            rc -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen > 0) {
+            msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base + rc;
+            msg.msg_iov->iov_len -= rc;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Like searches, readbacks send a snapshot: a client that stops reading must
+ * not hold the lock, which would stall the commit thread and every writer.
+ */
+int store_send_history(struct data_store *store, int client_fd) {
+    struct snapshot snapshot;
+    struct iovec iov;
+    int rc = 0;
+
+    if (take_snapshot(store, &snapshot) == -1)
+        return -1;
+
+    if (snapshot.len > 0) {
+        iov.iov_base = snapshot.data;
+        iov.iov_len = snapshot.len;
+        rc = send_iov(client_fd, &iov, 1);
+    }
+
+    release_snapshot(&snapshot);
+    return rc;
+}
+
+int store_send_matches(struct data_store *store, int client_fd, const char *pattern, size_t pattern_len) {
+    struct snapshot snapshot;
+    struct iovec iov[STORE_SEND_IOV];
+    const char *pos, *end, *match;
+    int count = 0, rc = 0;
+
+    if (take_snapshot(store, &snapshot) == -1)
+        return -1;
+
+    pos = snapshot.data;
+    end = snapshot.data + snapshot.len;
+    while (pos < end && (match = search_find(pos, end - pos, pattern, pattern_len))) {
+        const char *line = memrchr(pos, '\n', match - pos);
+        const char *line_end = memchr(match, '\n', end - match);
+
+        // Packets are whole lines, send the one around the match
+        line = line ? line + 1 : pos;
+        line_end = line_end ? line_end + 1 : end;
+
+        iov[count].iov_base = (void *)line;
+        iov[count].iov_len = line_end - line;
+        if (++count == STORE_SEND_IOV) {
+            if ((rc = send_iov(client_fd, iov, count)) == -1)
+                break;
+            count = 0;
+        }
+        pos = line_end;
+    }
+
+    if (rc == 0 && count > 0)
+        rc = send_iov(client_fd, iov, count);
+
+    release_snapshot(&snapshot);
+    return rc;
+}
+
+int store_open_readonly(struct data_store *store) {
+    int fd = open(store->path, O_RDONLY | O_CLOEXEC);
+
+    if (fd == -1)
+        AESD_LOG(LOG_ERR, LOG_TYPE_DATA, "Error opening file %s: %s", store->path, strerror(errno));
+    return fd;
+}
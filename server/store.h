@@ -0,0 +1,111 @@
+/*
+ * store.h
+ *
+ * The history aesdsocket appends packets to and reads back from, either a
+ * regular file or the aesdchar device. Connection threads hand their packets
+ * to a dedicated commit thread through a lock-free queue; the commit thread
+ * writes whatever has queued up with a single writev() and wakes the
+ * producers once their packets are in the file.
+ */
+
+#ifndef STORE_H
+#define STORE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+#include "aesd-lockfree-ring.h"
+
+#define STORE_QUEUE_SIZE 1024
+#define STORE_BATCH_MAX 64
+
+/**
+ * Called by the commit thread with every batch it wrote, before the producers
+ * are woken: the @param count buffers at @param iov are only valid during the call.
+ */
+typedef void (*store_commit_hook)(void *arg, const struct iovec *iov, int count);
+
+struct commit_status {
+    size_t ticket;
+    int result;
+};
+
+struct data_store {
+    char path[PATH_MAX];
+    int commit_fd;
+    struct aesd_mpsc_ring queue;
+    pthread_t commit_thread;
+    pthread_mutex_t commit_mutex;
+    /**
+     * Signalled by producers when they queue a packet
+     */
+    pthread_cond_t work_cond;
+    /**
+     * Broadcast by the commit thread after every batch
+     */
+    pthread_cond_t done_cond;
+    /**
+     * Every ticket below this one has been written, protected by commit_mutex
+     */
+    size_t committed;
+    /**
+     * Result of the most recent tickets, indexed by ticket modulo the queue size
+     */
+    struct commit_status *status;
+    int last_result;
+    bool stopping;
+    /**
+     * Held exclusively while writing, shared while reading the history back
+     */
+    pthread_rwlock_t file_lock;
+    atomic_ulong packets;
+    atomic_ulong bytes;
+    /**
+     * Optional, set before the first commit
+     */
+    store_commit_hook commit_hook;
+    void *commit_hook_arg;
+};
+
+/**
+ * Open @param path, creating it if needed, and start the commit thread of a store kept there.
+ * @return 0 on success, -1 on error.
+ */
+int store_init(struct data_store *store, const char *path);
+
+/**
+ * Commit everything still queued, stop the commit thread and sync the file.
+ */
+void store_destroy(struct data_store *store);
+
+/**
+ * Append @param len bytes of complete packets at @param data, blocking until they
+ * have been written. @param data only needs to stay valid until this returns.
+ * @return 0 on success, -1 if the write failed.
+ */
+int store_commit(struct data_store *store, const char *data, size_t len);
+
+/**
+ * Send the whole history to @param client_fd.
+ * @return 0 on success, -1 on error.
+ */
+int store_send_history(struct data_store *store, int client_fd);
+
+/**
+ * Send every packet of the history containing the @param pattern_len bytes at
+ * @param pattern to @param client_fd. Works on a snapshot of the history, so
+ * commits go on while the search runs.
+ * @return 0 on success, -1 on error.
+ */
+int store_send_matches(struct data_store *store, int client_fd, const char *pattern, size_t pattern_len);
+
+/**
+ * @return a new read only descriptor of the history, or -1 on error.
+ */
+int store_open_readonly(struct data_store *store);
+
+#endif /* STORE_H */
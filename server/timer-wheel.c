@@ -0,0 +1,220 @@
+/**
+ * @file timer-wheel.c
+ * @brief Hierarchical timer wheel with O(1) insert and cancel
+ *
+ * Level 0 holds the timers due within the next TW_SLOTS ticks, one slot per
+ * tick. Each higher level covers TW_SLOTS times the span of the level below
+ * it, and its slots are cascaded down one at a time whenever the lower level
+ * wraps around, as in the classic Linux kernel timer wheel.
+ */
+
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/timerfd.h>
+
+#include "timer-wheel.h"
+
+#define TW_MAX_TICKS (((uint64_t)1 << (TW_LEVELS * TW_LEVEL_BITS)) - 1)
+
+static void tw_unlink(struct tw_timer *timer)
+{
+    *timer->pprev = timer->next;
+    if (timer->next)
+        timer->next->pprev = timer->pprev;
+    timer->next = NULL;
+    timer->pprev = NULL;
+}
+
+static void tw_link(struct timer_wheel *wheel, struct tw_timer *timer)
+{
+    uint64_t delta;
+    int level;
+    struct tw_timer **slot;
+
+    // Anything already overdue fires on the next tick processed
+    if (timer->expires < wheel->now)
+        timer->expires = wheel->now;
+
+    delta = timer->expires - wheel->now;
+    if (delta > TW_MAX_TICKS) {
+        delta = TW_MAX_TICKS;
+        timer->expires = wheel->now + delta;
+    }
+
+    for (level = 0; level < TW_LEVELS - 1; level++) {
+        if (delta < ((uint64_t)1 << ((level + 1) * TW_LEVEL_BITS)))
+            break;
+    }
+
+    slot = &wheel->slots[level][(timer->expires >> (level * TW_LEVEL_BITS)) & TW_SLOT_MASK];
+    timer->next = *slot;
+    if (timer->next)
+        timer->next->pprev = &timer->next;
+    timer->pprev = slot;
+    *slot = timer;
+}
+
+/**
+ * Move every timer in the current slot of @param level down to the levels below.
+ * @return the slot index which was cascaded, 0 meaning the next level must cascade too.
+ */
+static size_t tw_cascade(struct timer_wheel *wheel, int level)
+{
+    size_t index = (wheel->now >> (level * TW_LEVEL_BITS)) & TW_SLOT_MASK;
+    struct tw_timer *timer = wheel->slots[level][index];
+
+    wheel->slots[level][index] = NULL;
+    while (timer) {
+        struct tw_timer *next = timer->next;
+        tw_link(wheel, timer);
+        timer = next;
+    }
+
+    return index;
+}
+
+static void tw_tick(struct timer_wheel *wheel)
+{
+    size_t index = wheel->now & TW_SLOT_MASK;
+    struct tw_timer *expired;
+    int level;
+
+    if (index == 0) {
+        for (level = 1; level < TW_LEVELS; level++) {
+            if (tw_cascade(wheel, level) != 0)
+                break;
+        }
+    }
+
+    // Move the slot onto the expired list, where the timers stay cancellable until they fire
+    expired = wheel->slots[0][index];
+    wheel->slots[0][index] = NULL;
+    while (expired) {
+        struct tw_timer *timer = expired;
+
+        expired = timer->next;
+        timer->next = wheel->expired;
+        if (timer->next)
+            timer->next->pprev = &timer->next;
+        timer->pprev = &wheel->expired;
+        wheel->expired = timer;
+    }
+
+    wheel->now++;
+}
+
+int timer_wheel_init(struct timer_wheel *wheel, unsigned int tick_ms)
+{
+    struct itimerspec its;
+
+    memset(wheel, 0, sizeof(struct timer_wheel));
+    wheel->tick_ms = tick_ms ? tick_ms : 1;
+
+    wheel->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (wheel->timer_fd == -1)
+        return -1;
+
+    its.it_interval.tv_sec = wheel->tick_ms / 1000;
+    its.it_interval.tv_nsec = (wheel->tick_ms % 1000) * 1000000L;
+    its.it_value = its.it_interval;
+    if (timerfd_settime(wheel->timer_fd, 0, &its, NULL) == -1) {
+        int err = errno;
+        close(wheel->timer_fd);
+        errno = err;
+        return -1;
+    }
+
+    pthread_mutex_init(&wheel->lock, NULL);
+    pthread_cond_init(&wheel->callback_done, NULL);
+    return 0;
+}
+
+void timer_wheel_destroy(struct timer_wheel *wheel)
+{
+    close(wheel->timer_fd);
+    pthread_mutex_destroy(&wheel->lock);
+    pthread_cond_destroy(&wheel->callback_done);
+}
+
+int timer_wheel_fd(const struct timer_wheel *wheel)
+{
+    return wheel->timer_fd;
+}
+
+void tw_timer_init(struct tw_timer *timer, tw_callback_t callback, void *arg)
+{
+    memset(timer, 0, sizeof(struct tw_timer));
+    timer->callback = callback;
+    timer->arg = arg;
+}
+
+bool tw_timer_pending(const struct tw_timer *timer)
+{
+    return timer->pprev != NULL;
+}
+
+static uint64_t tw_ms_to_ticks(const struct timer_wheel *wheel, unsigned int ms)
+{
+    return (ms + wheel->tick_ms - 1) / wheel->tick_ms;
+}
+
+void timer_wheel_add(struct timer_wheel *wheel, struct tw_timer *timer,
+        unsigned int timeout_ms, unsigned int interval_ms)
+{
+    uint64_t ticks = tw_ms_to_ticks(wheel, timeout_ms);
+
+    pthread_mutex_lock(&wheel->lock);
+    if (tw_timer_pending(timer))
+        tw_unlink(timer);
+
+    // wheel->now is the tick about to be processed, so a one tick timeout lands on it
+    timer->expires = wheel->now + (ticks ? ticks - 1 : 0);
+    timer->interval = interval_ms ? tw_ms_to_ticks(wheel, interval_ms) : 0;
+    tw_link(wheel, timer);
+    pthread_mutex_unlock(&wheel->lock);
+}
+
+void timer_wheel_cancel(struct timer_wheel *wheel, struct tw_timer *timer)
+{
+    pthread_mutex_lock(&wheel->lock);
+    if (tw_timer_pending(timer))
+        tw_unlink(timer);
+    while (wheel->running == timer)
+        pthread_cond_wait(&wheel->callback_done, &wheel->lock);
+    pthread_mutex_unlock(&wheel->lock);
+}
+
+void timer_wheel_run(struct timer_wheel *wheel)
+{
+    uint64_t expirations;
+
+    if (read(wheel->timer_fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+        return;
+
+    pthread_mutex_lock(&wheel->lock);
+    while (expirations--)
+        tw_tick(wheel);
+
+    /*
+     * Callbacks may block, the timestamp one on disk writes, so they run unlocked
+     * and connections re-arming their idle timers meanwhile don't wait for them
+     */
+    while (wheel->expired) {
+        struct tw_timer *timer = wheel->expired;
+
+        tw_unlink(timer);
+        if (timer->interval) {
+            timer->expires += timer->interval;
+            tw_link(wheel, timer);
+        }
+
+        wheel->running = timer;
+        pthread_mutex_unlock(&wheel->lock);
+        timer->callback(timer, timer->arg);
+        pthread_mutex_lock(&wheel->lock);
+        wheel->running = NULL;
+        pthread_cond_broadcast(&wheel->callback_done);
+    }
+    pthread_mutex_unlock(&wheel->lock);
+}
@@ -0,0 +1,103 @@
+/*
+ * timer-wheel.h
+ *
+ * Hierarchical timer wheel driven by a timerfd, used by aesdsocket for
+ * periodic work (timestamps, metrics) and per-connection idle timeouts.
+ */
+
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#define TW_LEVELS 4
+#define TW_LEVEL_BITS 6
+#define TW_SLOTS (1 << TW_LEVEL_BITS)
+#define TW_SLOT_MASK (TW_SLOTS - 1)
+
+struct tw_timer;
+
+typedef void (*tw_callback_t)(struct tw_timer *timer, void *arg);
+
+/**
+ * A timer embedded in the structure which owns it. Insert and cancel are O(1)
+ * since a timer only ever needs unlinking from the slot list it sits in.
+ */
+struct tw_timer {
+    struct tw_timer *next;
+    struct tw_timer **pprev;
+    /**
+     * Absolute expiry, in ticks of the owning wheel
+     */
+    uint64_t expires;
+    /**
+     * Re-arm period in ticks, 0 for a one-shot timer
+     */
+    uint64_t interval;
+    tw_callback_t callback;
+    void *arg;
+};
+
+struct timer_wheel {
+    struct tw_timer *slots[TW_LEVELS][TW_SLOTS];
+    /**
+     * The next tick to be processed
+     */
+    uint64_t now;
+    unsigned int tick_ms;
+    int timer_fd;
+    /**
+     * Timers that became due, waiting for timer_wheel_run() to call them
+     */
+    struct tw_timer *expired;
+    /**
+     * Timer whose callback timer_wheel_run() is calling, outside the lock
+     */
+    struct tw_timer *running;
+    pthread_mutex_t lock;
+    /**
+     * Signalled whenever a callback returns, for timer_wheel_cancel()
+     */
+    pthread_cond_t callback_done;
+};
+
+/**
+ * Create the timerfd backing @param wheel, ticking every @param tick_ms milliseconds.
+ * @return 0 on success, -1 with errno set on failure.
+ */
+int timer_wheel_init(struct timer_wheel *wheel, unsigned int tick_ms);
+
+void timer_wheel_destroy(struct timer_wheel *wheel);
+
+/**
+ * @return the file descriptor to poll for readability; call timer_wheel_run() when it is.
+ */
+int timer_wheel_fd(const struct timer_wheel *wheel);
+
+void tw_timer_init(struct tw_timer *timer, tw_callback_t callback, void *arg);
+
+/**
+ * (Re)arm @param timer to fire after @param timeout_ms, and then every
+ * @param interval_ms if non-zero. A pending timer is moved, not duplicated.
+ */
+void timer_wheel_add(struct timer_wheel *wheel, struct tw_timer *timer,
+        unsigned int timeout_ms, unsigned int interval_ms);
+
+/**
+ * Cancel @param timer if pending, and wait for its callback if it is running. Once this
+ * returns the callback is guaranteed not to be running and the timer may be freed.
+ */
+void timer_wheel_cancel(struct timer_wheel *wheel, struct tw_timer *timer);
+
+bool tw_timer_pending(const struct tw_timer *timer);
+
+/**
+ * Consume the timerfd expirations and fire every timer that became due. Callbacks run
+ * without the wheel lock, so they may block without holding up timer_wheel_add(), but
+ * must not cancel their own timer; use the interval for periodic timers.
+ */
+void timer_wheel_run(struct timer_wheel *wheel);
+
+#endif /* TIMER_WHEEL_H */
@@ -0,0 +1,91 @@
+#include "unity.h"
+#include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "../../examples/systemcalls/systemcalls.h"
+
+/**
+* Every command gets its own wait status, a failing or missing command fails the batch
+* but does not stop the others from running.
+*/
+void test_exec_batch_status()
+{
+    char *const echo_argv[] = { "/bin/echo", "home is $HOME", NULL };
+    char *const true_argv[] = { "/bin/true", NULL };
+    char *const false_argv[] = { "/bin/false", NULL };
+    char *const missing_argv[] = { "echo", "relative paths are not expanded", NULL };
+    struct exec_command commands[] = {
+        { .argv = echo_argv, .outputfile = "/tmp/aesd-batch-echo.txt" },
+        { .argv = true_argv },
+        { .argv = false_argv },
+        { .argv = missing_argv },
+    };
+    char buffer[64] = "";
+    FILE *output;
+
+    TEST_ASSERT_FALSE_MESSAGE(do_exec_batch(commands, 4, 2),
+            "do_exec_batch() should fail when one of the commands fails");
+
+    TEST_ASSERT_TRUE_MESSAGE(WIFEXITED(commands[0].status) && WEXITSTATUS(commands[0].status) == 0,
+            "/bin/echo should exit with status 0");
+    TEST_ASSERT_TRUE_MESSAGE(WIFEXITED(commands[1].status) && WEXITSTATUS(commands[1].status) == 0,
+            "/bin/true should exit with status 0");
+    TEST_ASSERT_TRUE_MESSAGE(WIFEXITED(commands[2].status) && WEXITSTATUS(commands[2].status) == 1,
+            "/bin/false should exit with status 1");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(-1, commands[3].status,
+            "A command that cannot be started should report status -1");
+
+    output = fopen("/tmp/aesd-batch-echo.txt", "r");
+    TEST_ASSERT_NOT_NULL_MESSAGE(output, "The output file of /bin/echo should exist");
+    TEST_ASSERT_NOT_NULL(fgets(buffer, sizeof(buffer), output));
+    fclose(output);
+    TEST_ASSERT_EQUAL_STRING_MESSAGE("home is $HOME\n", buffer,
+            "The output of /bin/echo should be redirected without shell expansion");
+}
+
+/**
+* Each command checks how many others are running when it starts, through a file
+* it keeps in a shared directory until it exits.
+*/
+void test_exec_batch_max_parallel()
+{
+    char script[256];
+    char *const check_argv[] = { "/bin/sh", "-c", script, NULL };
+    struct exec_command commands[8];
+    char dir[] = "/tmp/aesd-batch-XXXXXX";
+
+    TEST_ASSERT_NOT_NULL(mkdtemp(dir));
+    snprintf(script, sizeof(script),
+             "test $(ls %s | wc -l) -lt 2 || exit 1; touch %s/$$; sleep 0.1; rm %s/$$",
+             dir, dir, dir);
+
+    for (int i = 0; i < 8; i++) {
+        commands[i] = (struct exec_command) { .argv = check_argv };
+    }
+
+    TEST_ASSERT_TRUE_MESSAGE(do_exec_batch(commands, 8, 2),
+            "No more than 2 commands should run at the same time");
+    for (int i = 0; i < 8; i++) {
+        TEST_ASSERT_TRUE_MESSAGE(WIFEXITED(commands[i].status) && WEXITSTATUS(commands[i].status) == 0,
+                "Every command of the batch should have run");
+    }
+
+    TEST_ASSERT_EQUAL_INT(0, rmdir(dir));
+}
+
+/**
+* A max_parallel of 0 runs one command per online CPU, an empty batch succeeds.
+*/
+void test_exec_batch_defaults()
+{
+    char *const true_argv[] = { "/bin/true", NULL };
+    struct exec_command commands[3] = {
+        { .argv = true_argv },
+        { .argv = true_argv },
+        { .argv = true_argv },
+    };
+
+    TEST_ASSERT_TRUE(do_exec_batch(commands, 3, 0));
+    TEST_ASSERT_TRUE(do_exec_batch(NULL, 0, 0));
+}